@@ -8,6 +8,14 @@
 #include "libcallaudio.h"
 #include "callaudiod.h"
 #include "callaudio-dbus.h"
+#include "cad-state-page.h"
+
+#include <gio/gunixfdlist.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /**
  * SECTION:libcallaudio
@@ -37,12 +45,166 @@
 
 static CallAudioDbusCallAudio *_proxy;
 static gboolean               _initted;
+static const CadStatePage    *_state_page;
+
+/* Number of attempts at reading a consistent state page snapshot */
+#define STATE_PAGE_RETRIES 16
+
+static void map_state_page(void)
+{
+    g_autoptr(GUnixFDList) fd_list = NULL;
+    g_autoptr(GVariant) handle = NULL;
+    g_autoptr(GError) err = NULL;
+    const CadStatePage *page;
+    gint fd;
+
+    if (!call_audio_dbus_call_audio_call_get_state_page_sync(_proxy, NULL, &handle,
+                                                             &fd_list, NULL, &err)) {
+        g_debug("state page unavailable: %s", err->message);
+        return;
+    }
+
+    fd = g_unix_fd_list_get(fd_list, g_variant_get_handle(handle), &err);
+    if (fd < 0) {
+        g_debug("unable to get state page fd: %s", err->message);
+        return;
+    }
+
+    page = mmap(NULL, sizeof(CadStatePage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        g_debug("unable to map state page: %s", g_strerror(errno));
+        return;
+    }
+
+    if (page->magic != CAD_STATE_PAGE_MAGIC ||
+        page->version != CAD_STATE_PAGE_VERSION ||
+        page->size < sizeof(CadStatePage)) {
+        g_debug("unsupported state page");
+        munmap((gpointer)page, sizeof(CadStatePage));
+        return;
+    }
+
+    _state_page = page;
+}
+
+static void unmap_state_page(void)
+{
+    if (_state_page) {
+        munmap((gpointer)_state_page, sizeof(CadStatePage));
+        _state_page = NULL;
+    }
+}
+
+static gboolean read_state_page(CallAudioState *state)
+{
+    CadStatePage copy;
+    gint seq;
+    int i;
+
+    for (i = 0; i < STATE_PAGE_RETRIES; i++) {
+        seq = g_atomic_int_get(&_state_page->sequence);
+        if (seq & 1)
+            continue;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        memcpy(&copy, _state_page, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (g_atomic_int_get(&_state_page->sequence) != seq)
+            continue;
+
+        if (copy.closed)
+            return FALSE;
+
+        state->generation = copy.generation;
+        state->mode = copy.mode;
+        state->speaker = copy.speaker;
+        state->mic = copy.mic;
+        state->available = copy.available;
+        g_strlcpy(state->output_port, copy.output_port, sizeof(state->output_port));
+        g_strlcpy(state->input_port, copy.input_port, sizeof(state->input_port));
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void peer_closed_cb(GDBusConnection *connection,
+                           gboolean remote_peer_vanished,
+                           GError *error,
+                           gpointer user_data)
+{
+    g_autoptr(GError) err = NULL;
+
+    if (!_proxy ||
+        g_dbus_proxy_get_connection(G_DBUS_PROXY(_proxy)) != connection)
+        return;
+
+    g_debug("peer connection closed, falling back to the bus");
+
+    /* The page won't be updated anymore, the daemon flagged it as closed */
+    unmap_state_page();
+    g_clear_object(&_proxy);
+
+    _proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
+                                    CALLAUDIO_DBUS_TYPE,0, CALLAUDIO_DBUS_NAME,
+                                    CALLAUDIO_DBUS_PATH, NULL, &err);
+    if (!_proxy) {
+        g_warning("Unable to connect to the bus: %s", err->message);
+        return;
+    }
+
+    g_object_add_weak_pointer(G_OBJECT(_proxy), (gpointer *)&_proxy);
+    map_state_page();
+}
+
+/*
+ * Try the daemon's private socket first: it avoids going through dbus-daemon
+ * for each request. Returns NULL if the daemon can't be reached this way.
+ */
+static CallAudioDbusCallAudio *connect_peer(void)
+{
+    g_autoptr(GDBusConnection) connection = NULL;
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *address = NULL;
+    g_autoptr(GError) err = NULL;
+    CallAudioDbusCallAudio *proxy;
+
+    path = g_build_filename(g_get_user_runtime_dir(), CALLAUDIO_PEER_SOCKET, NULL);
+    if (!g_file_test(path, G_FILE_TEST_EXISTS))
+        return NULL;
+
+    address = g_strdup_printf("unix:path=%s", path);
+    connection = g_dbus_connection_new_for_address_sync(address,
+                                    G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                    NULL, NULL, &err);
+    if (!connection) {
+        g_debug("unable to connect to %s: %s", path, err->message);
+        return NULL;
+    }
+
+    proxy = call_audio_dbus_call_audio_proxy_new_sync(connection, 0, NULL,
+                                                      CALLAUDIO_DBUS_PATH,
+                                                      NULL, &err);
+    if (!proxy) {
+        g_debug("unable to create peer proxy: %s", err->message);
+        return NULL;
+    }
+
+    g_signal_connect(connection, "closed", G_CALLBACK(peer_closed_cb), NULL);
+    g_debug("connected to %s", path);
+
+    return proxy;
+}
 
 /**
  * call_audio_init:
  * @error: Error information
  *
  * Initialize libcallaudio. This must be called before any other functions.
+ * The daemon is reached through its private socket when possible, and through
+ * the session bus otherwise.
  *
  * Returns: %TRUE if successful, or %FALSE on error.
  */
@@ -51,13 +213,17 @@ gboolean call_audio_init(GError **error)
     if (_initted)
         return TRUE;
 
-    _proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
+    _proxy = connect_peer();
+    if (!_proxy) {
+        _proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
                                     CALLAUDIO_DBUS_TYPE,0, CALLAUDIO_DBUS_NAME,
                                     CALLAUDIO_DBUS_PATH, NULL, error);
+    }
     if (!_proxy)
         return FALSE;
 
     g_object_add_weak_pointer(G_OBJECT(_proxy), (gpointer *)&_proxy);
+    map_state_page();
 
     _initted = TRUE;
     return TRUE;
@@ -85,6 +251,7 @@ gboolean call_audio_is_inited(void)
 void call_audio_deinit(void)
 {
     _initted = FALSE;
+    unmap_state_page();
     g_clear_object(&_proxy);
 }
 
@@ -287,3 +454,327 @@ gboolean call_audio_mute_mic(gboolean mute, GError **error)
 
     return (ret && success);
 }
+
+static GVariant *build_route(CallAudioMode mode, CallAudioSpeakerState speaker,
+                             CallAudioMicState mic)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+
+    if (mode != CALL_AUDIO_MODE_UNKNOWN)
+        g_variant_builder_add(&builder, "{sv}", "mode", g_variant_new_uint32(mode));
+    if (speaker != CALL_AUDIO_SPEAKER_UNKNOWN)
+        g_variant_builder_add(&builder, "{sv}", "speaker",
+                              g_variant_new_boolean(speaker == CALL_AUDIO_SPEAKER_ON));
+    if (mic != CALL_AUDIO_MIC_UNKNOWN)
+        g_variant_builder_add(&builder, "{sv}", "mute",
+                              g_variant_new_boolean(mic == CALL_AUDIO_MIC_OFF));
+
+    return g_variant_builder_end(&builder);
+}
+
+static void apply_route_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    CallAudioDbusCallAudio *proxy = CALL_AUDIO_DBUS_CALL_AUDIO(object);
+    CallAudioCallback cb = data;
+    GError *error = NULL;
+    gboolean success = FALSE;
+    gboolean ret;
+
+    g_return_if_fail(CALL_AUDIO_DBUS_IS_CALL_AUDIO(proxy));
+
+    ret = call_audio_dbus_call_audio_call_apply_route_finish(proxy, &success,
+                                                             result, &error);
+    if (!ret)
+        g_warning("ApplyRoute failed: %s", error->message);
+    else if (!success)
+        g_warning("ApplyRoute failed with code %d", success);
+
+    g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
+
+    if (cb)
+        cb(ret && success, error);
+}
+
+/**
+ * call_audio_apply_route_async:
+ * @mode: Audio mode to select, or %CALL_AUDIO_MODE_UNKNOWN to keep it
+ * @speaker: Desired speaker state, or %CALL_AUDIO_SPEAKER_UNKNOWN to keep it
+ * @mic: Desired microphone state, or %CALL_AUDIO_MIC_UNKNOWN to keep it
+ * @cb: Function to be called when operation completes
+ *
+ * Select the audio mode, speaker and microphone states in a single
+ * operation.
+ */
+gboolean call_audio_apply_route_async(CallAudioMode         mode,
+                                      CallAudioSpeakerState speaker,
+                                      CallAudioMicState     mic,
+                                      CallAudioCallback     cb)
+{
+    if (!_initted)
+        return FALSE;
+
+    call_audio_dbus_call_audio_call_apply_route(_proxy, build_route(mode, speaker, mic),
+                                                NULL, apply_route_done, cb);
+
+    return TRUE;
+}
+
+/**
+ * call_audio_apply_route:
+ * @mode: Audio mode to select, or %CALL_AUDIO_MODE_UNKNOWN to keep it
+ * @speaker: Desired speaker state, or %CALL_AUDIO_SPEAKER_UNKNOWN to keep it
+ * @mic: Desired microphone state, or %CALL_AUDIO_MIC_UNKNOWN to keep it
+ *
+ * Select the audio mode, speaker and microphone states in a single
+ * operation. This function is synchronous, and will return only once the
+ * operation has been executed.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_apply_route(CallAudioMode         mode,
+                                CallAudioSpeakerState speaker,
+                                CallAudioMicState     mic,
+                                GError              **error)
+{
+    gboolean success = FALSE;
+    gboolean ret;
+
+    if (!_initted)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_apply_route_sync(_proxy,
+                                                           build_route(mode, speaker, mic),
+                                                           &success, NULL, error);
+    if (error && *error)
+        g_critical("Couldn't apply route: %s", (*error)->message);
+
+    g_debug("ApplyRoute %s: success=%d", ret ? "succeeded" : "failed", success);
+
+    return (ret && success);
+}
+
+static void prepare_call_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    CallAudioDbusCallAudio *proxy = CALL_AUDIO_DBUS_CALL_AUDIO(object);
+    CallAudioCallback cb = data;
+    GError *error = NULL;
+    gboolean success = FALSE;
+    gboolean ret;
+
+    g_return_if_fail(CALL_AUDIO_DBUS_IS_CALL_AUDIO(proxy));
+
+    ret = call_audio_dbus_call_audio_call_prepare_call_finish(proxy, &success,
+                                                              result, &error);
+    if (!ret)
+        g_warning("PrepareCall failed: %s", error->message);
+
+    g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
+
+    if (cb)
+        cb(ret && success, error);
+}
+
+/**
+ * call_audio_prepare_call_async:
+ * @cb: Function to be called when operation completes
+ *
+ * Let the daemon prepare the routing of an incoming call while it rings, so
+ * selecting %CALL_AUDIO_MODE_CALL once it is answered completes faster.
+ * Nothing needs to be done if the call is rejected.
+ */
+gboolean call_audio_prepare_call_async(CallAudioCallback cb)
+{
+    if (!_initted)
+        return FALSE;
+
+    call_audio_dbus_call_audio_call_prepare_call(_proxy, NULL, prepare_call_done, cb);
+
+    return TRUE;
+}
+
+/**
+ * call_audio_prepare_call:
+ * @error: Error information
+ *
+ * Let the daemon prepare the routing of an incoming call while it rings, so
+ * selecting %CALL_AUDIO_MODE_CALL once it is answered completes faster.
+ * Nothing needs to be done if the call is rejected. This function is
+ * synchronous.
+ *
+ * Returns: %TRUE if the routing was prepared, or %FALSE on error or if
+ * there was nothing to prepare for the devices in use.
+ */
+gboolean call_audio_prepare_call(GError **error)
+{
+    gboolean success = FALSE;
+    gboolean ret;
+
+    if (!_initted)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_prepare_call_sync(_proxy, &success, NULL, error);
+    if (error && *error)
+        g_critical("Couldn't prepare call: %s", (*error)->message);
+
+    g_debug("PrepareCall %s: success=%d", ret ? "succeeded" : "failed", success);
+
+    return (ret && success);
+}
+
+/**
+ * call_audio_begin_call:
+ * @handle: (out): location to store the call session handle
+ * @error: Error information
+ *
+ * Begin a call session: the voice call mode is selected when no other
+ * session is active, and kept until the last session ends. Unlike
+ * call_audio_select_mode(), this lets several applications hold calls at
+ * the same time. The session ends automatically if the application exits
+ * or loses its connection to the daemon. This function is synchronous, and
+ * will return only once the voice call mode has been selected.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_begin_call(guint *handle, GError **error)
+{
+    gboolean ret;
+
+    g_return_val_if_fail(handle != NULL, FALSE);
+
+    if (!_initted)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_begin_call_sync(_proxy, handle, NULL, error);
+    if (error && *error)
+        g_critical("Couldn't begin call: %s", (*error)->message);
+
+    g_debug("BeginCall %s: handle=%u", ret ? "succeeded" : "failed", ret ? *handle : 0);
+
+    return ret;
+}
+
+/**
+ * call_audio_end_call:
+ * @handle: Call session handle, as returned by call_audio_begin_call()
+ * @error: Error information
+ *
+ * End a call session, restoring the default mode if no other session is
+ * active. This function is synchronous, and will return only once the
+ * operation has been executed.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_end_call(guint handle, GError **error)
+{
+    gboolean success = FALSE;
+    gboolean ret;
+
+    if (!_initted)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_end_call_sync(_proxy, handle, &success,
+                                                        NULL, error);
+    if (error && *error)
+        g_critical("Couldn't end call %u: %s", handle, (*error)->message);
+
+    g_debug("EndCall %s: success=%d", ret ? "succeeded" : "failed", success);
+
+    return (ret && success);
+}
+
+/**
+ * call_audio_get_audio_mode:
+ *
+ * Get the current audio mode. The value is kept up to date by the daemon
+ * and doesn't require a D-Bus round-trip.
+ *
+ * Returns: The current #CallAudioMode, or %CALL_AUDIO_MODE_UNKNOWN if the
+ * library isn't initialized or the mode can't be determined.
+ */
+CallAudioMode call_audio_get_audio_mode(void)
+{
+    if (!_initted)
+        return CALL_AUDIO_MODE_UNKNOWN;
+
+    return call_audio_dbus_call_audio_get_audio_mode(_proxy);
+}
+
+/**
+ * call_audio_get_speaker_state:
+ *
+ * Get the current speaker state.
+ *
+ * Returns: The current #CallAudioSpeakerState, or
+ * %CALL_AUDIO_SPEAKER_UNKNOWN if it can't be determined.
+ */
+CallAudioSpeakerState call_audio_get_speaker_state(void)
+{
+    if (!_initted)
+        return CALL_AUDIO_SPEAKER_UNKNOWN;
+
+    return call_audio_dbus_call_audio_get_speaker_state(_proxy);
+}
+
+/**
+ * call_audio_get_mic_state:
+ *
+ * Get the current microphone state.
+ *
+ * Returns: The current #CallAudioMicState, or %CALL_AUDIO_MIC_UNKNOWN if it
+ * can't be determined.
+ */
+CallAudioMicState call_audio_get_mic_state(void)
+{
+    if (!_initted)
+        return CALL_AUDIO_MIC_UNKNOWN;
+
+    return call_audio_dbus_call_audio_get_mic_state(_proxy);
+}
+
+/**
+ * call_audio_is_available:
+ *
+ * Query whether the daemon found a usable sound card, i.e. whether routing
+ * requests can be executed.
+ *
+ * Returns: %TRUE if call audio routing is available, %FALSE otherwise.
+ */
+gboolean call_audio_is_available(void)
+{
+    if (!_initted)
+        return FALSE;
+
+    return call_audio_dbus_call_audio_get_available(_proxy);
+}
+
+/**
+ * call_audio_get_state:
+ * @state: (out caller-allocates): location to store the current state
+ *
+ * Get a snapshot of the current daemon state. When available, this reads the
+ * state page shared by the daemon, which doesn't involve any D-Bus traffic;
+ * otherwise the cached D-Bus properties are used and port names are left
+ * empty.
+ *
+ * Returns: %TRUE if @state was filled, %FALSE if the library isn't initialized.
+ */
+gboolean call_audio_get_state(CallAudioState *state)
+{
+    g_return_val_if_fail(state != NULL, FALSE);
+
+    if (!_initted)
+        return FALSE;
+
+    if (_state_page && read_state_page(state))
+        return TRUE;
+
+    memset(state, 0, sizeof(*state));
+    state->mode = call_audio_dbus_call_audio_get_audio_mode(_proxy);
+    state->speaker = call_audio_dbus_call_audio_get_speaker_state(_proxy);
+    state->mic = call_audio_dbus_call_audio_get_mic_state(_proxy);
+    state->available = call_audio_dbus_call_audio_get_available(_proxy);
+
+    return TRUE;
+}
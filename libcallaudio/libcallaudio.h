@@ -15,6 +15,8 @@ G_BEGIN_DECLS
  * CallAudioMode:
  * @CALL_AUDIO_MODE_DEFAULT: Default mode (used for music, alarms, ringtones...)
  * @CALL_AUDIO_MODE_CALL: Voice call mode
+ * @CALL_AUDIO_MODE_HOLD: Voice call mode, with the call on hold
+ * @CALL_AUDIO_MODE_UNKNOWN: Mode unknown
  *
  * Enum values to indicate the mode to be selected.
  */
@@ -22,8 +24,62 @@ G_BEGIN_DECLS
 typedef enum _CallAudioMode {
   CALL_AUDIO_MODE_DEFAULT = 0,
   CALL_AUDIO_MODE_CALL,
+  CALL_AUDIO_MODE_HOLD,
+  CALL_AUDIO_MODE_UNKNOWN = 255
 } CallAudioMode;
 
+/**
+ * CallAudioSpeakerState:
+ * @CALL_AUDIO_SPEAKER_OFF: Speaker disabled
+ * @CALL_AUDIO_SPEAKER_ON: Speaker enabled
+ * @CALL_AUDIO_SPEAKER_UNKNOWN: Speaker state unknown
+ *
+ * Enum values to indicate the state of the speaker.
+ */
+
+typedef enum _CallAudioSpeakerState {
+  CALL_AUDIO_SPEAKER_OFF = 0,
+  CALL_AUDIO_SPEAKER_ON,
+  CALL_AUDIO_SPEAKER_UNKNOWN = 255
+} CallAudioSpeakerState;
+
+/**
+ * CallAudioMicState:
+ * @CALL_AUDIO_MIC_OFF: Microphone muted
+ * @CALL_AUDIO_MIC_ON: Microphone active
+ * @CALL_AUDIO_MIC_UNKNOWN: Microphone state unknown
+ *
+ * Enum values to indicate the state of the microphone.
+ */
+
+typedef enum _CallAudioMicState {
+  CALL_AUDIO_MIC_OFF = 0,
+  CALL_AUDIO_MIC_ON,
+  CALL_AUDIO_MIC_UNKNOWN = 255
+} CallAudioMicState;
+
+/**
+ * CallAudioState:
+ * @generation: incremented by the daemon on each state change
+ * @mode: current audio mode
+ * @speaker: current speaker state
+ * @mic: current microphone state
+ * @available: whether call audio routing is available
+ * @output_port: name of the active output port, empty if unknown
+ * @input_port: name of the active input port, empty if unknown
+ *
+ * Snapshot of the daemon state, as returned by call_audio_get_state().
+ */
+typedef struct _CallAudioState {
+  guint64               generation;
+  CallAudioMode         mode;
+  CallAudioSpeakerState speaker;
+  CallAudioMicState     mic;
+  gboolean              available;
+  gchar                 output_port[64];
+  gchar                 input_port[64];
+} CallAudioState;
+
 typedef void (*CallAudioCallback)(gboolean success, GError *error);
 
 gboolean call_audio_init     (GError **error);
@@ -42,4 +98,25 @@ gboolean call_audio_mute_mic      (gboolean mute, GError **error);
 gboolean call_audio_mute_mic_async(gboolean          mute,
                                    CallAudioCallback cb);
 
+gboolean call_audio_apply_route      (CallAudioMode         mode,
+                                      CallAudioSpeakerState speaker,
+                                      CallAudioMicState     mic,
+                                      GError              **error);
+gboolean call_audio_apply_route_async(CallAudioMode         mode,
+                                      CallAudioSpeakerState speaker,
+                                      CallAudioMicState     mic,
+                                      CallAudioCallback     cb);
+
+gboolean call_audio_prepare_call      (GError **error);
+gboolean call_audio_prepare_call_async(CallAudioCallback cb);
+
+gboolean call_audio_begin_call(guint *handle, GError **error);
+gboolean call_audio_end_call  (guint  handle, GError **error);
+
+CallAudioMode         call_audio_get_audio_mode   (void);
+CallAudioSpeakerState call_audio_get_speaker_state(void);
+CallAudioMicState     call_audio_get_mic_state    (void);
+gboolean              call_audio_is_available     (void);
+gboolean              call_audio_get_state        (CallAudioState *state);
+
 G_END_DECLS
@@ -9,8 +9,15 @@
 #include "callaudiod.h"
 #include "cad-manager.h"
 #include "cad-pulse.h"
+#include "cad-scheduler.h"
+#include "cad-session.h"
+#include "cad-state.h"
+#include "cad-stats.h"
+
+#include "libcallaudio.h"
 
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <glib-unix.h>
 
 typedef struct _CadManager {
@@ -29,6 +36,8 @@ static void complete_command_cb(CadOperation *op)
     if (!op)
         return;
 
+    cad_stats_record_operation(op);
+
     if (op->success) {
         switch (op->type) {
         case CAD_OPERATION_SELECT_MODE:
@@ -40,10 +49,17 @@ static void complete_command_cb(CadOperation *op)
         case CAD_OPERATION_MUTE_MIC:
             call_audio_dbus_call_audio_complete_mute_mic(op->object, op->invocation, op->success);
             break;
+        case CAD_OPERATION_APPLY_ROUTE:
+            call_audio_dbus_call_audio_complete_apply_route(op->object, op->invocation, op->success);
+            break;
         default:
             g_critical("unknown operation %d", op->type);
             break;
         }
+    } else if (op->error == CAD_OPERATION_ERROR_SUPERSEDED) {
+        g_dbus_method_invocation_return_dbus_error(op->invocation,
+                                                   CALLAUDIO_DBUS_ERROR_SUPERSEDED,
+                                                   "Operation superseded by a newer request");
     } else {
         g_dbus_method_invocation_return_error(op->invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_FAILED,
@@ -59,29 +75,38 @@ static gboolean cad_manager_handle_select_mode(CallAudioDbusCallAudio *object,
 {
     CadOperation *op;
 
-    if (mode >= 2) {
+    if (mode > CALL_AUDIO_MODE_HOLD) {
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_INVALID_ARGS,
                                               "Invalid mode %u", mode);
-        return FALSE;
+        return TRUE;
     }
 
-    op = g_new(CadOperation, 1);
+    /* Legacy clients leave the call mode when hanging up, whatever sessions do */
+    if (mode == CALL_AUDIO_MODE_DEFAULT && cad_session_active()) {
+        g_debug("Select mode: call sessions active, keeping voice call mode");
+        call_audio_dbus_call_audio_complete_select_mode(object, invocation, TRUE);
+        return TRUE;
+    }
+
+    op = g_new0(CadOperation, 1);
     if (!op) {
         g_critical("Unable to allocate memory for select mode operation");
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_NO_MEMORY,
                                               "Failed to allocate operation");
-        return FALSE;
+        return TRUE;
     }
 
     op->type = CAD_OPERATION_SELECT_MODE;
     op->object = object;
     op->invocation = invocation;
     op->callback = complete_command_cb;
+    op->received = g_get_monotonic_time();
+    op->value = mode;
 
     g_debug("Select mode: %u", mode);
-    cad_pulse_select_mode(mode, op);
+    cad_scheduler_push(op);
     return TRUE;
 }
 
@@ -91,22 +116,24 @@ static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object
 {
     CadOperation *op;
 
-    op = g_new(CadOperation, 1);
+    op = g_new0(CadOperation, 1);
     if (!op) {
         g_critical("Unable to allocate memory for speaker operation");
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_NO_MEMORY,
                                               "Failed to allocate operation");
-        return FALSE;
+        return TRUE;
     }
 
     op->type = CAD_OPERATION_ENABLE_SPEAKER;
     op->object = object;
     op->invocation = invocation;
     op->callback = complete_command_cb;
+    op->received = g_get_monotonic_time();
+    op->value = enable;
 
     g_debug("Enable speaker: %d", enable);
-    cad_pulse_enable_speaker(enable, op);
+    cad_scheduler_push(op);
     return TRUE;
 }
 
@@ -116,28 +143,146 @@ static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
 {
     CadOperation *op;
 
-    op = g_new(CadOperation, 1);
+    op = g_new0(CadOperation, 1);
     if (!op) {
         g_critical("Unable to allocate memory for mic operation");
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_NO_MEMORY,
                                               "Failed to allocate operation");
-        return FALSE;
+        return TRUE;
     }
 
     op->type = CAD_OPERATION_MUTE_MIC;
     op->object = object;
     op->invocation = invocation;
     op->callback = complete_command_cb;
+    op->received = g_get_monotonic_time();
+    op->value = mute;
 
     g_debug("Mute mic: %d", mute);
-    cad_pulse_mute_mic(mute, op);
+    cad_scheduler_push(op);
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_apply_route(CallAudioDbusCallAudio *object,
+                                               GDBusMethodInvocation *invocation,
+                                               GVariant *route)
+{
+    CadOperation *op;
+    guint mode = CALL_AUDIO_MODE_UNKNOWN;
+    gboolean speaker, mute;
+
+    op = g_new0(CadOperation, 1);
+    if (!op) {
+        g_critical("Unable to allocate memory for route operation");
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_NO_MEMORY,
+                                              "Failed to allocate operation");
+        return TRUE;
+    }
+
+    op->type = CAD_OPERATION_APPLY_ROUTE;
+    op->object = object;
+    op->invocation = invocation;
+    op->callback = complete_command_cb;
+    op->received = g_get_monotonic_time();
+    op->route.mode = CALL_AUDIO_MODE_UNKNOWN;
+    op->route.speaker = CALL_AUDIO_SPEAKER_UNKNOWN;
+    op->route.mic = CALL_AUDIO_MIC_UNKNOWN;
+
+    if (g_variant_lookup(route, "mode", "u", &mode)) {
+        if (mode > CALL_AUDIO_MODE_HOLD) {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                                  G_DBUS_ERROR_INVALID_ARGS,
+                                                  "Invalid mode %u", mode);
+            free(op);
+            return TRUE;
+        }
+        if (mode == CALL_AUDIO_MODE_DEFAULT && cad_session_active()) {
+            g_debug("Apply route: call sessions active, keeping voice call mode");
+            mode = CALL_AUDIO_MODE_UNKNOWN;
+        }
+        op->route.mode = mode;
+    }
+    if (g_variant_lookup(route, "speaker", "b", &speaker))
+        op->route.speaker = speaker ? CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF;
+    if (g_variant_lookup(route, "mute", "b", &mute))
+        op->route.mic = mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON;
+
+    g_debug("Apply route: mode=%u speaker=%u mic=%u",
+            op->route.mode, op->route.speaker, op->route.mic);
+    cad_scheduler_push(op);
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_prepare_call(CallAudioDbusCallAudio *object,
+                                                GDBusMethodInvocation *invocation)
+{
+    g_debug("Prepare call");
+    call_audio_dbus_call_audio_complete_prepare_call(object, invocation,
+                                                     cad_pulse_prepare_call());
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_begin_call(CallAudioDbusCallAudio *object,
+                                              GDBusMethodInvocation *invocation)
+{
+    g_debug("Begin call");
+    cad_session_begin(object, invocation);
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_end_call(CallAudioDbusCallAudio *object,
+                                            GDBusMethodInvocation *invocation,
+                                            guint handle)
+{
+    g_debug("End call: %u", handle);
+    cad_session_end(object, invocation, handle);
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_get_state_page(CallAudioDbusCallAudio *object,
+                                                  GDBusMethodInvocation *invocation,
+                                                  GUnixFDList *fd_list)
+{
+    g_autoptr(GUnixFDList) out_fd_list = NULL;
+    g_autoptr(GError) error = NULL;
+    gint idx;
+
+    if (cad_state_get_fd() < 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_NOT_SUPPORTED,
+                                              "State page unavailable");
+        return TRUE;
+    }
+
+    out_fd_list = g_unix_fd_list_new();
+    idx = g_unix_fd_list_append(out_fd_list, cad_state_get_fd(), &error);
+    if (idx < 0) {
+        g_dbus_method_invocation_return_gerror(invocation, error);
+        return TRUE;
+    }
+
+    call_audio_dbus_call_audio_complete_get_state_page(object, invocation, out_fd_list,
+                                                       g_variant_new_handle(idx));
     return TRUE;
 }
 
 static void cad_manager_constructed(GObject *object)
 {
+    CadPulse *pulse = cad_pulse_get_default();
+
     G_OBJECT_CLASS(cad_manager_parent_class)->constructed(object);
+
+    /* The skeleton emits PropertiesChanged whenever those are updated */
+    g_object_bind_property(pulse, "audio-mode", object, "audio-mode",
+                           G_BINDING_SYNC_CREATE);
+    g_object_bind_property(pulse, "speaker-state", object, "speaker-state",
+                           G_BINDING_SYNC_CREATE);
+    g_object_bind_property(pulse, "mic-state", object, "mic-state",
+                           G_BINDING_SYNC_CREATE);
+    g_object_bind_property(pulse, "available", object, "available",
+                           G_BINDING_SYNC_CREATE);
 }
 
 static void cad_manager_dispose(GObject *object)
@@ -150,6 +295,11 @@ static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface
     iface->handle_select_mode = cad_manager_handle_select_mode;
     iface->handle_enable_speaker = cad_manager_handle_enable_speaker;
     iface->handle_mute_mic = cad_manager_handle_mute_mic;
+    iface->handle_apply_route = cad_manager_handle_apply_route;
+    iface->handle_prepare_call = cad_manager_handle_prepare_call;
+    iface->handle_begin_call = cad_manager_handle_begin_call;
+    iface->handle_end_call = cad_manager_handle_end_call;
+    iface->handle_get_state_page = cad_manager_handle_get_state_page;
 }
 
 static void cad_manager_class_init(CadManagerClass *klass)
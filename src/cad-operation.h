@@ -13,8 +13,27 @@ typedef enum {
     CAD_OPERATION_SELECT_MODE = 0,
     CAD_OPERATION_ENABLE_SPEAKER,
     CAD_OPERATION_MUTE_MIC,
+    CAD_OPERATION_APPLY_ROUTE,
+    /* Internal, ports selection following an availability change */
+    CAD_OPERATION_REROUTE,
+    /* Internal, last requested route applied again to new devices */
+    CAD_OPERATION_RESTORE,
 } CadOperationType;
 
+typedef enum {
+    CAD_OPERATION_ERROR_FAILED = 0,
+    CAD_OPERATION_ERROR_SUPERSEDED,
+} CadOperationError;
+
+/*
+ * Combined routing request, CALL_AUDIO_*_UNKNOWN values meaning "unchanged"
+ */
+typedef struct _CadRoute {
+    guint mode;
+    guint speaker;
+    guint mic;
+} CadRoute;
+
 typedef struct _CadOperation CadOperation;
 
 typedef void (*CadOperationCallback)(CadOperation *op);
@@ -24,5 +43,14 @@ struct _CadOperation {
     CallAudioDbusCallAudio *object;
     GDBusMethodInvocation *invocation;
     CadOperationCallback callback;
+    guint value;
+    CadRoute route;
     gboolean success;
+    CadOperationError error;
+    /* Mode change issued for call sessions, see cad-session.c */
+    gboolean session;
+
+    /* Monotonic timestamps: D-Bus receipt, and first PA request (or 0) */
+    gint64 received;
+    gint64 started;
 };
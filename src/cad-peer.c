@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-peer"
+
+#include "cad-peer.h"
+#include "cad-manager.h"
+#include "cad-stats.h"
+#include "callaudiod.h"
+
+#include <glib/gstdio.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Besides the bus name, the manager is exported on a private unix socket so
+ * clients can talk to us directly instead of going through dbus-daemon,
+ * which can be slow to respond when many services are busy at call setup.
+ * The stats interface is exported as well.
+ * Only peers running as our own user are accepted.
+ *
+ * The server is only started once the bus name is ours, so another instance
+ * can't take the socket over from the one running.
+ */
+
+static GDBusServer *server;
+static GDBusAuthObserver *observer;
+static GDBusInterfaceSkeleton *exported[2];
+static gchar *socket_path;
+/* Identity of the socket we created, so we only ever remove that one */
+static dev_t socket_dev;
+static ino_t socket_ino;
+
+static gboolean allow_mechanism_cb(GDBusAuthObserver *observer,
+                                   const gchar *mechanism,
+                                   gpointer user_data)
+{
+    return g_strcmp0(mechanism, "EXTERNAL") == 0;
+}
+
+static gboolean authorize_peer_cb(GDBusAuthObserver *observer,
+                                  GIOStream *stream,
+                                  GCredentials *credentials,
+                                  gpointer user_data)
+{
+    g_autoptr(GError) err = NULL;
+    uid_t uid;
+
+    if (!credentials) {
+        g_debug("rejecting peer without credentials");
+        return FALSE;
+    }
+
+    uid = g_credentials_get_unix_user(credentials, &err);
+    if (uid == (uid_t)-1 || uid != getuid()) {
+        g_debug("rejecting peer with uid %d", (gint)uid);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void connection_closed_cb(GDBusConnection *connection,
+                                 gboolean remote_peer_vanished,
+                                 GError *error,
+                                 gpointer user_data)
+{
+    guint i;
+
+    g_debug("peer connection %p closed", connection);
+
+    for (i = 0; i < G_N_ELEMENTS(exported); i++)
+        g_dbus_interface_skeleton_unexport_from_connection(exported[i], connection);
+    g_signal_handlers_disconnect_by_func(connection, connection_closed_cb, user_data);
+    g_object_unref(connection);
+}
+
+static gboolean new_connection_cb(GDBusServer *server,
+                                  GDBusConnection *connection,
+                                  gpointer user_data)
+{
+    g_autoptr(GError) err = NULL;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(exported); i++) {
+        if (!g_dbus_interface_skeleton_export(exported[i], connection,
+                                              CALLAUDIO_DBUS_PATH, &err)) {
+            g_warning("Unable to export interface on peer connection: %s", err->message);
+            while (i-- > 0)
+                g_dbus_interface_skeleton_unexport_from_connection(exported[i], connection);
+            return FALSE;
+        }
+    }
+
+    g_debug("new peer connection %p", connection);
+
+    g_object_ref(connection);
+    g_signal_connect(connection, "closed", G_CALLBACK(connection_closed_cb), NULL);
+
+    return TRUE;
+}
+
+gboolean cad_peer_start(GError **error)
+{
+    g_autofree gchar *address = NULL;
+    g_autofree gchar *guid = NULL;
+    GStatBuf st;
+
+    if (server)
+        return TRUE;
+
+    socket_path = g_build_filename(g_get_user_runtime_dir(),
+                                   CALLAUDIO_PEER_SOCKET, NULL);
+    // Remove any stale socket left behind by a previous instance
+    g_unlink(socket_path);
+
+    address = g_strdup_printf("unix:path=%s", socket_path);
+    guid = g_dbus_generate_guid();
+
+    observer = g_dbus_auth_observer_new();
+    g_signal_connect(observer, "allow-mechanism",
+                     G_CALLBACK(allow_mechanism_cb), NULL);
+    g_signal_connect(observer, "authorize-authenticated-peer",
+                     G_CALLBACK(authorize_peer_cb), NULL);
+
+    server = g_dbus_server_new_sync(address, G_DBUS_SERVER_FLAGS_NONE, guid,
+                                    observer, NULL, error);
+    if (!server) {
+        g_clear_object(&observer);
+        g_clear_pointer(&socket_path, g_free);
+        return FALSE;
+    }
+
+    exported[0] = G_DBUS_INTERFACE_SKELETON(g_object_ref(cad_manager_get_default()));
+    exported[1] = G_DBUS_INTERFACE_SKELETON(g_object_ref(cad_stats_get_default()));
+    g_signal_connect(server, "new-connection", G_CALLBACK(new_connection_cb), NULL);
+    g_dbus_server_start(server);
+
+    if (g_stat(socket_path, &st) == 0) {
+        socket_dev = st.st_dev;
+        socket_ino = st.st_ino;
+    }
+
+    g_debug("peer server listening on %s", socket_path);
+
+    return TRUE;
+}
+
+void cad_peer_stop(void)
+{
+    GStatBuf st;
+
+    if (!server)
+        return;
+
+    g_dbus_server_stop(server);
+    g_clear_object(&server);
+    g_clear_object(&observer);
+    g_clear_object(&exported[0]);
+    g_clear_object(&exported[1]);
+
+    if (g_stat(socket_path, &st) == 0 && st.st_dev == socket_dev && st.st_ino == socket_ino)
+        g_unlink(socket_path);
+    g_clear_pointer(&socket_path, g_free);
+}
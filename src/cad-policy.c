@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-policy"
+
+#include "cad-policy.h"
+#include "config.h"
+
+#include <alsa/use-case.h>
+
+#include <string.h>
+
+/*
+ * The routing policy tells which cards, profiles and ports are used for
+ * what. It is only looked at when devices are discovered or refreshed, to
+ * classify them, routing decisions then rely on these classes.
+ *
+ * It is read from SYSCONFDIR/callaudiod/policy.conf, or failing that from
+ * DATADIR/callaudiod/policy.conf; built-in defaults are used for anything
+ * which isn't set. Card properties must be equal to one of the listed
+ * values, profile and port names only have to contain one.
+ */
+
+typedef struct _CadPolicy {
+    GStrv internal_bus_paths;
+    GStrv internal_form_factors;
+    GStrv headset_form_factors;
+    GStrv ignored_classes;
+    GStrv voicecall_profiles;
+    GStrv default_profiles;
+    GStrv speaker_ports;
+    GStrv earpiece_ports;
+    GStrv headphones_ports;
+    GStrv headset_mic_ports;
+    GStrv builtin_mic_ports;
+    GStrv parking_ports;
+} CadPolicy;
+
+static const struct {
+    const gchar *group;
+    const gchar *key;
+    gsize offset;
+    const gchar *defaults;
+} policy_keys[] = {
+    { "Cards", "InternalBusPaths",
+      G_STRUCT_OFFSET(CadPolicy, internal_bus_paths), "platform-sound" },
+    { "Cards", "InternalFormFactors",
+      G_STRUCT_OFFSET(CadPolicy, internal_form_factors), "internal" },
+    { "Cards", "HeadsetFormFactors",
+      G_STRUCT_OFFSET(CadPolicy, headset_form_factors), "headset;handset;hands-free" },
+    { "Cards", "IgnoredClasses",
+      G_STRUCT_OFFSET(CadPolicy, ignored_classes), "modem" },
+    { "Profiles", "VoiceCall",
+      G_STRUCT_OFFSET(CadPolicy, voicecall_profiles),
+      SND_USE_CASE_VERB_VOICECALL ";voicecall;handsfree_head_unit;headset_head_unit;headset-head-unit" },
+    { "Profiles", "Default",
+      G_STRUCT_OFFSET(CadPolicy, default_profiles),
+      SND_USE_CASE_VERB_HIFI ";default;a2dp_sink;a2dp-sink" },
+    { "Ports", "Speaker",
+      G_STRUCT_OFFSET(CadPolicy, speaker_ports), SND_USE_CASE_DEV_SPEAKER ";output-speaker" },
+    { "Ports", "Earpiece",
+      G_STRUCT_OFFSET(CadPolicy, earpiece_ports), SND_USE_CASE_DEV_EARPIECE ";output-earpiece" },
+    { "Ports", "Headphones",
+      G_STRUCT_OFFSET(CadPolicy, headphones_ports),
+      SND_USE_CASE_DEV_HEADPHONES ";" SND_USE_CASE_DEV_HEADSET ";output-wired_head" },
+    { "Ports", "HeadsetMic",
+      G_STRUCT_OFFSET(CadPolicy, headset_mic_ports),
+      SND_USE_CASE_DEV_HEADSET ";input-wired_headset" },
+    { "Ports", "BuiltinMic",
+      G_STRUCT_OFFSET(CadPolicy, builtin_mic_ports), SND_USE_CASE_DEV_MIC ";input-builtin_mic" },
+    { "Ports", "Parking",
+      G_STRUCT_OFFSET(CadPolicy, parking_ports), "output-parking;input-parking" },
+};
+
+static CadPolicy policy;
+static gboolean loaded;
+
+static void policy_clear(CadPolicy *p)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(policy_keys); i++) {
+        GStrv *field = G_STRUCT_MEMBER_P(p, policy_keys[i].offset);
+
+        g_clear_pointer(field, g_strfreev);
+    }
+}
+
+/*
+ * Look for the policy file: returns FALSE if one exists but can't be
+ * loaded, otherwise @keyfile is set to the one found, if any.
+ */
+static gboolean load_file(GKeyFile **keyfile, gchar **path)
+{
+    const gchar *dirs[] = { SYSCONFDIR, DATADIR, NULL };
+    guint i;
+
+    *keyfile = NULL;
+    *path = NULL;
+
+    for (i = 0; dirs[i]; i++) {
+        g_autoptr(GKeyFile) file = g_key_file_new();
+        g_autofree gchar *filename = NULL;
+        g_autoptr(GError) err = NULL;
+
+        filename = g_build_filename(dirs[i], APP_DATA_NAME, CAD_POLICY_FILE, NULL);
+        if (g_key_file_load_from_file(file, filename, G_KEY_FILE_NONE, &err)) {
+            *keyfile = g_steal_pointer(&file);
+            *path = g_steal_pointer(&filename);
+            return TRUE;
+        }
+
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Unable to load routing policy from %s: %s", filename, err->message);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * (Re)load the policy. If the file can't be parsed, the current policy is
+ * kept, or the built-in one used at startup.
+ */
+void cad_policy_load(void)
+{
+    g_autoptr(GKeyFile) keyfile = NULL;
+    g_autofree gchar *path = NULL;
+    CadPolicy new_policy = { NULL };
+    guint i;
+
+    if (!load_file(&keyfile, &path) && loaded) {
+        g_warning("Keeping the current routing policy");
+        return;
+    }
+
+    if (keyfile)
+        g_debug("routing policy loaded from %s", path);
+    else
+        g_debug("using the built-in routing policy");
+
+    for (i = 0; i < G_N_ELEMENTS(policy_keys); i++) {
+        GStrv *field = G_STRUCT_MEMBER_P(&new_policy, policy_keys[i].offset);
+
+        if (keyfile)
+            *field = g_key_file_get_string_list(keyfile, policy_keys[i].group,
+                                                policy_keys[i].key, NULL, NULL);
+        if (!*field)
+            *field = g_strsplit(policy_keys[i].defaults, ";", -1);
+    }
+
+    policy_clear(&policy);
+    policy = new_policy;
+    loaded = TRUE;
+}
+
+static const CadPolicy *get_policy(void)
+{
+    if (!loaded)
+        cad_policy_load();
+
+    return &policy;
+}
+
+static gboolean contains_any(const gchar *str, GStrv patterns)
+{
+    guint i;
+
+    for (i = 0; patterns[i]; i++) {
+        if (patterns[i][0] != '\0' && strstr(str, patterns[i]) != NULL)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+guint cad_policy_classify_port(const gchar *name)
+{
+    const CadPolicy *p = get_policy();
+    guint classes = 0;
+
+    if (contains_any(name, p->speaker_ports))
+        classes |= CAD_POLICY_PORT_SPEAKER;
+    if (contains_any(name, p->earpiece_ports))
+        classes |= CAD_POLICY_PORT_EARPIECE;
+    if (contains_any(name, p->headphones_ports))
+        classes |= CAD_POLICY_PORT_HEADPHONES;
+    if (contains_any(name, p->headset_mic_ports))
+        classes |= CAD_POLICY_PORT_HEADSET_MIC;
+    if (contains_any(name, p->builtin_mic_ports))
+        classes |= CAD_POLICY_PORT_BUILTIN_MIC;
+    if (contains_any(name, p->parking_ports))
+        classes |= CAD_POLICY_PORT_PARKING;
+
+    return classes;
+}
+
+/*
+ * Properties missing from the card don't prevent it from being considered
+ * as the internal one.
+ */
+CadPolicyCardClass cad_policy_classify_card(const gchar *bus_path,
+                                            const gchar *form_factor,
+                                            const gchar *device_class)
+{
+    const CadPolicy *p = get_policy();
+
+    if (device_class && g_strv_contains((const gchar * const *)p->ignored_classes, device_class))
+        return CAD_POLICY_CARD_IGNORED;
+
+    if (form_factor && g_strv_contains((const gchar * const *)p->headset_form_factors, form_factor))
+        return CAD_POLICY_CARD_HEADSET;
+
+    if ((!bus_path || g_strv_contains((const gchar * const *)p->internal_bus_paths, bus_path)) &&
+        (!form_factor || g_strv_contains((const gchar * const *)p->internal_form_factors, form_factor)))
+        return CAD_POLICY_CARD_INTERNAL;
+
+    return CAD_POLICY_CARD_OTHER;
+}
+
+gboolean cad_policy_match_profile(const gchar *name, CadPolicyProfile profile)
+{
+    const CadPolicy *p = get_policy();
+
+    if (!name)
+        return FALSE;
+
+    switch (profile) {
+    case CAD_POLICY_PROFILE_DEFAULT:
+        return contains_any(name, p->default_profiles);
+    case CAD_POLICY_PROFILE_VOICECALL:
+        return contains_any(name, p->voicecall_profiles);
+    default:
+        return FALSE;
+    }
+}
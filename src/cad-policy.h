@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define CAD_POLICY_FILE "policy.conf"
+
+/* Classes of ports, as a bitmask */
+typedef enum {
+    CAD_POLICY_PORT_SPEAKER     = 1 << 0,
+    CAD_POLICY_PORT_EARPIECE    = 1 << 1,
+    CAD_POLICY_PORT_HEADPHONES  = 1 << 2,
+    CAD_POLICY_PORT_HEADSET_MIC = 1 << 3,
+    CAD_POLICY_PORT_BUILTIN_MIC = 1 << 4,
+    CAD_POLICY_PORT_PARKING     = 1 << 5,
+} CadPolicyPortClass;
+
+typedef enum {
+    CAD_POLICY_CARD_IGNORED = 0,
+    CAD_POLICY_CARD_OTHER,
+    CAD_POLICY_CARD_INTERNAL,
+    CAD_POLICY_CARD_HEADSET,
+} CadPolicyCardClass;
+
+typedef enum {
+    CAD_POLICY_PROFILE_DEFAULT = 0,
+    CAD_POLICY_PROFILE_VOICECALL,
+} CadPolicyProfile;
+
+void cad_policy_load(void);
+
+guint cad_policy_classify_port(const gchar *name);
+CadPolicyCardClass cad_policy_classify_card(const gchar *bus_path,
+                                            const gchar *form_factor,
+                                            const gchar *device_class);
+gboolean cad_policy_match_profile(const gchar *name, CadPolicyProfile profile);
+
+G_END_DECLS
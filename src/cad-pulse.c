@@ -8,6 +8,10 @@
 #define G_LOG_DOMAIN "callaudiod-pulse"
 
 #include "cad-pulse.h"
+#include "cad-policy.h"
+#include "cad-scheduler.h"
+#include "cad-state.h"
+#include "cad-stats.h"
 
 #include "libcallaudio.h"
 
@@ -15,7 +19,6 @@
 #include <glib-object.h>
 #include <pulse/pulseaudio.h>
 #include <pulse/glib-mainloop.h>
-#include <alsa/use-case.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -24,23 +27,130 @@
 #define APPLICATION_ID   "org.mobian-project.CallAudio"
 
 #define SINK_CLASS "sound"
-#define CARD_BUS_PATH "platform-sound"
-#define CARD_FORM_FACTOR "internal"
-#define CARD_MODEM_CLASS "modem"
+
+#define BLUEZ_API_NAME "bluez"
+/* Name of the latency statistics for Bluetooth profile switches */
+#define BLUEZ_SWITCH_STAT "bluez-profile-switch"
+
+/* Streams with this media role are moved to the devices used for calls */
+#define PHONE_ROLE "phone"
+
+/*
+ * Preference for using a card for calls: external devices meant for calls
+ * (USB-C or BT headsets) come before the built-in card, and any other card
+ * is only a fallback. Cards which can't be used at all have no rank.
+ */
+#define CARD_RANK_NONE     0
+#define CARD_RANK_OTHER    10
+#define CARD_RANK_INTERNAL 20
+#define CARD_RANK_HEADSET  30
+#define CARD_RANK_VOICE_PROFILE_BONUS 5
+
+/*
+ * Bounds of the time a step may wait for PA to reply before its operation is
+ * failed; the actual value is derived from the round-trip times measured for
+ * this kind of step.
+ */
+#define WATCHDOG_MIN_TIMEOUT 1000   /* ms */
+#define WATCHDOG_MAX_TIMEOUT 10000  /* ms */
+#define WATCHDOG_DEFAULT_TIMEOUT 3000  /* ms, until the first measure */
+
+/* Delay before reconnecting to PA, doubled after each failed attempt */
+#define RECONNECT_DELAY_MIN 100   /* ms */
+#define RECONNECT_DELAY_MAX 5000  /* ms */
+
+/* Time during which subscription events are coalesced */
+#define EVENT_BATCH_DELAY 5  /* ms */
 
 #define WITH_DROID_SUPPORT 1 /* FIXME: wire into meson */
 
 #ifdef WITH_DROID_SUPPORT
 #define DROID_API_NAME "droid-hal"
-#define DROID_PROFILE_HIFI "default"
-#define DROID_PROFILE_VOICECALL "voicecall"
-#define DROID_OUTPUT_PORT_PARKING "output-parking"
-#define DROID_OUTPUT_PORT_SPEAKER "output-speaker"
-#define DROID_INPUT_PORT_PARKING "input-parking"
-#define DROID_INPUT_PORT_BUILTIN_MIC "input-builtin_mic"
-#define DROID_INPUT_PORT_WIRED_HEADSET_MIC "input-wired_headset"
 #endif /* WITH_DROID_SUPPORT */
 
+/*
+ * Cached view of a sink or source port, kept up to date from PA
+ * subscription events so routing decisions don't need an info query. Ports
+ * are classified once when read, so selecting one involves no string work.
+ */
+typedef struct _CadPulsePort {
+    /* Position of the port's name in the device's port_names */
+    guint index;
+    /* CadPolicyPortClass flags */
+    guint classes;
+    guint32 priority;
+    int available;
+} CadPulsePort;
+
+typedef struct _CadPulseDevice {
+    guint32 index;
+    guint32 card;
+    gchar *name;
+#ifdef WITH_DROID_SUPPORT
+    gboolean is_droid;
+#endif /* WITH_DROID_SUPPORT */
+    /* Array of CadPulsePort, and their names */
+    GArray *ports;
+    GPtrArray *port_names;
+    /* Positions of the active and speaker ports, or -1 */
+    gint active_port;
+    gint speaker_port;
+    gboolean mute;
+} CadPulseDevice;
+
+typedef struct _CadPulseCard {
+    guint32 index;
+    guint rank;
+    gboolean has_voice_profile;
+    gchar *active_profile;
+
+    /* Best available profiles for calls and otherwise, per the policy */
+    gchar *call_profile;
+    gchar *media_profile;
+
+    gboolean is_bluez;
+    /* When the profile switch being waited for was requested, or 0 */
+    gint64 switch_start;
+} CadPulseCard;
+
+/*
+ * Ports to select for a call, computed while the phone rings so answering it
+ * only has writes to issue. A plan is dropped as soon as the devices used
+ * for calls or their ports availability change, so a valid one always
+ * matches the cache.
+ */
+typedef struct _CadPulsePlan {
+    gboolean valid;
+    guint32 sink;
+    guint32 source;
+    gint output_port;
+    gint input_port;
+} CadPulsePlan;
+
+/* Call put on hold, with the mute states to restore on resume */
+typedef struct _CadPulseHold {
+    gboolean active;
+    gboolean sink_mute;
+    gboolean source_mute;
+    /* Devices still muted by a dropped hold, see drop_hold() */
+    gchar *sink_name;
+    gchar *source_name;
+} CadPulseHold;
+
+/* Stream with the phone role, and the sink or source it's connected to */
+typedef struct _CadPulseStream {
+    guint32 index;
+    guint32 device;
+} CadPulseStream;
+
+/* Subscription event waiting to be processed */
+typedef struct _CadPulseEvent {
+    guint64 key;
+    guint facility;
+    guint kind;
+    uint32_t idx;
+} CadPulseEvent;
+
 struct _CadPulse
 {
     GObject parent_instance;
@@ -48,855 +158,3265 @@ struct _CadPulse
     pa_glib_mainloop  *loop;
     pa_context        *ctx;
 
-    int card_id;
-    int sink_id;
-    int source_id;
+    /* Cards, and sound sinks and sources known to PA, by index */
+    GHashTable *cards;
+    GHashTable *sinks;
+    GHashTable *sources;
 
-#ifdef WITH_DROID_SUPPORT
-    gboolean sink_is_droid;
-    gboolean source_is_droid;
-#endif /* WITH_DROID_SUPPORT */
+    /* Phone streams, by index */
+    GHashTable *sink_inputs;
+    GHashTable *source_outputs;
 
-    gboolean has_voice_profile;
-    gchar *speaker_port;
+    /* Devices currently used for calls, owned by the tables above */
+    CadPulseCard *card;
+    CadPulseDevice *sink;
+    CadPulseDevice *source;
 
     CallAudioMode current_mode;
-};
 
-G_DEFINE_TYPE(CadPulse, cad_pulse, G_TYPE_OBJECT);
+    /* Prepared by cad_pulse_prepare_call(), if any */
+    CadPulsePlan plan;
 
-typedef struct _CadPulseOperation {
-    CadPulse *pulse;
-    CadOperation *op;
-    guint value;
-} CadPulseOperation;
+    CadPulseHold hold;
 
-#ifdef WITH_DROID_SUPPORT
-static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol, void *data);
-static void set_input_port(pa_context *ctx, const pa_source_info *info, int eol, void *data);
-#endif /* WITH_DROID_SUPPORT */
+    /* In-flight operations, so they can be cancelled */
+    GList *operations;
+    /* Step name -> CadPulseRtt */
+    GHashTable *rtt;
 
-static const gchar *get_available_output(const pa_sink_info *sink, const gchar *exclude)
-{
-    pa_sink_port_info *available_port = NULL;
-    guint i;
+    /* Pending subscription events, in order, and indexed by object */
+    GQueue events;
+    GHashTable *event_index;
+    guint events_id;
 
-    g_debug("looking for available port excluding '%s'", exclude);
+    /*
+     * Whether requests can be executed: the context is connected, the model
+     * has been built and the last requested route restored after a reconnect
+     */
+    gboolean ready;
+    guint discovery_pending;
+    guint reconnect_id;
+    guint reconnect_delay;
+
+    /* Last requested route, reapplied after reconnecting to PA */
+    CadRoute requested;
+    CadOperation *restore_op;
+
+    /* Pending switch back to the default mode, see start_linger() */
+    guint linger_id;
+
+    /* State exported through the object properties */
+    CallAudioMode audio_mode;
+    CallAudioSpeakerState speaker_state;
+    CallAudioMicState mic_state;
+    gboolean available;
+};
 
-    for (i = 0; i < sink->n_ports; i++) {
-        pa_sink_port_info *port = sink->ports[i];
+G_DEFINE_TYPE(CadPulse, cad_pulse, G_TYPE_OBJECT);
 
-        if ((exclude && strcmp(port->name, exclude) == 0) ||
-            port->available == PA_PORT_AVAILABLE_NO) {
-            continue;
-        }
+enum {
+    PROP_0,
+    PROP_AUDIO_MODE,
+    PROP_SPEAKER_STATE,
+    PROP_MIC_STATE,
+    PROP_AVAILABLE,
+    PROP_READY,
+    PROP_LAST_PROP,
+};
+static GParamSpec *props[PROP_LAST_PROP];
 
-        if (!available_port || port->priority > available_port->priority)
-            available_port = port;
-    }
+static guint linger_time = CAD_PULSE_DEFAULT_LINGER;
 
-    if (available_port) {
-        g_debug("found available port '%s'", available_port->name);
-        return available_port->name;
-    }
+typedef struct _CadPulseOperation CadPulseOperation;
+typedef struct _CadPulseStep CadPulseStep;
 
-    g_warning("no available port found!");
+/*
+ * A routing step issues (at most) one PA write and returns the resulting
+ * pa_operation, or NULL if there was nothing to be done.
+ */
+typedef pa_operation *(*CadPulseStepFunc)(CadPulseOperation *operation,
+                                          CadPulseStep *step);
+
+typedef enum {
+    /* Run once all dependencies are done, whatever they did */
+    CAD_PULSE_STEP_AFTER = 0,
+    /* Only run if every dependency actually changed something */
+    CAD_PULSE_STEP_ON_CHANGE,
+} CadPulseStepMode;
+
+/* Targets for the output port selection step */
+typedef enum {
+    CAD_PULSE_OUTPUT_UNCHANGED = 0,
+    CAD_PULSE_OUTPUT_SPEAKER,
+    CAD_PULSE_OUTPUT_NO_SPEAKER,
+    CAD_PULSE_OUTPUT_BEST,
+} CadPulseOutput;
+
+struct _CadPulseStep {
+    const gchar *name;
+    CadPulseStepFunc func;
+    CadPulseOperation *operation;
+    CadPulseStepMode mode;
+    guint value;
 
-    return NULL;
-}
+    /* Steps waiting for this one to complete */
+    GPtrArray *dependents;
+    guint n_deps;
+    gboolean started;
 
-static const gchar *get_best_input(const pa_source_info *source, gboolean source_is_droid)
-{
-    /*
-     * get_best_input() works a bit differently than get_available_output():
-     *
-     * On droid, the input is chosen between the builtin_mic and the
-     * wired_headset mic if available.
-     *
-     * On native devices the mic with the highest priority gets
-     * chosen.
-    */
+    /* PA request currently in flight for this step, if any */
+    pa_operation *pa_op;
+    gint64 start_time;
+    guint watchdog_id;
 
-    pa_source_port_info *available_port = NULL;
-    guint i;
+    /* Set by the step function when the request couldn't be issued */
+    gboolean failed;
+    /* Set by the step function to wait for devices instead, see wait_devices() */
+    gboolean waiting;
+};
 
-    g_debug("Looking for available input port");
+/* Smoothed PA round-trip time for a kind of step, in microseconds */
+typedef struct _CadPulseRtt {
+    gint64 srtt;
+    gint64 rttvar;
+} CadPulseRtt;
 
-    for (i = 0; i < source->n_ports; i++) {
-        pa_source_port_info *port = source->ports[i];
+/*
+ * Each request is executed as a small dependency graph of steps: all steps
+ * whose dependencies are satisfied are sent to PA at the same time, and the
+ * request completes once every step has either finished or been skipped.
+ */
+struct _CadPulseOperation {
+    CadPulse *pulse;
+    CadOperation *op;
 
-        if (port->available == PA_PORT_AVAILABLE_NO)
-            continue;
+    /* Mode being applied, or CALL_AUDIO_MODE_UNKNOWN */
+    guint mode;
+    /* Plan prepared for this call, if any */
+    CadPulsePlan plan;
 
-#ifdef WITH_DROID_SUPPORT
-        if (source_is_droid) {
-            if (strcmp(port->name, DROID_INPUT_PORT_WIRED_HEADSET_MIC) == 0) {
-                /* wired_headset is the preferred one */
-                available_port = port;
-                break;
-            } else if (strcmp(port->name, DROID_INPUT_PORT_BUILTIN_MIC) == 0) {
-                /* builtin mic */
-                available_port = port;
-            }
-        } else if (!available_port || port->priority > available_port->priority) {
-            available_port = port;
-        }
-#else
-        if (!available_port || port->priority > available_port->priority)
-            available_port = port;
-#endif /* WITH_DROID_SUPPORT */
-    }
+    GPtrArray *steps;
+    guint n_pending;
+    gboolean running;
+    gboolean success;
+};
 
-    if (available_port) {
-        g_debug("found available input port '%s'", available_port->name);
-        return available_port->name;
-    }
-    
-    g_warning("no available input port found!");
+static void replace_string(gchar **str, const gchar *value)
+{
+    if (g_strcmp0(*str, value) == 0)
+        return;
 
-    return NULL;
+    g_free(*str);
+    *str = g_strdup(value);
 }
 
-static void process_new_source(CadPulse *self, const pa_source_info *info)
+static CadPulseDevice *device_new(guint32 index, const gchar *name)
 {
-    const gchar *prop;
+    CadPulseDevice *dev = g_new0(CadPulseDevice, 1);
 
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
-    if (prop && strcmp(prop, SINK_CLASS) != 0)
-        return;
-    if (info->card != self->card_id || self->source_id != -1)
-        return;
+    dev->index = index;
+    dev->name = g_strdup(name);
+    dev->ports = g_array_new(FALSE, FALSE, sizeof(CadPulsePort));
+    dev->port_names = g_ptr_array_new_with_free_func(g_free);
+    dev->active_port = -1;
+    dev->speaker_port = -1;
 
-    self->source_id = info->index;
+    return dev;
+}
 
-#ifdef WITH_DROID_SUPPORT
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
-    self->source_is_droid = (prop && strcmp(prop, DROID_API_NAME) == 0);
-#endif /* WITH_DROID_SUPPORT */
+static void device_free(CadPulseDevice *dev)
+{
+    g_array_unref(dev->ports);
+    g_ptr_array_unref(dev->port_names);
+    g_free(dev->name);
+    g_free(dev);
+}
+
+static void card_free(CadPulseCard *card)
+{
+    g_free(card->active_profile);
+    g_free(card->call_profile);
+    g_free(card->media_profile);
+    g_free(card);
+}
 
-    g_debug("SOURCE: idx=%u name='%s'", info->index, info->name);
+static const gchar *port_name(const CadPulseDevice *dev, gint port)
+{
+    return port >= 0 ? g_ptr_array_index(dev->port_names, port) : NULL;
 }
 
-static void process_sink_ports(CadPulse *self, const pa_sink_info *info)
+static gint find_port(const CadPulseDevice *dev, const gchar *name)
 {
-    int i;
+    guint i;
 
-    for (i = 0; i < info->n_ports; i++) {
-        pa_sink_port_info *port = info->ports[i];
+    if (!name)
+        return -1;
 
-#ifdef WITH_DROID_SUPPORT
-        if ((self->sink_is_droid && strcmp(port->name, DROID_OUTPUT_PORT_SPEAKER) == 0) ||
-            (!self->sink_is_droid && strstr(port->name, SND_USE_CASE_DEV_SPEAKER) != 0)) {
-#else
-        if (strstr(port->name, SND_USE_CASE_DEV_SPEAKER) != NULL) {
-#endif /* WITH_DROID_SUPPORT */
-            if (self->speaker_port) {
-                if (strcmp(port->name, self->speaker_port) != 0) {
-                    g_free(self->speaker_port);
-                    self->speaker_port = g_strdup(port->name);
-                }
-            } else {
-                self->speaker_port = g_strdup(port->name);
-            }
-        }
+    for (i = 0; i < dev->port_names->len; i++) {
+        if (strcmp(g_ptr_array_index(dev->port_names, i), name) == 0)
+            return i;
     }
 
-    g_debug("SINK:   speaker_port='%s'", self->speaker_port);
+    return -1;
 }
 
-static void process_new_sink(CadPulse *self, const pa_sink_info *info)
+static gint find_port_class(const CadPulseDevice *dev, guint classes)
 {
-    const gchar *prop;
-
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
-    if (prop && strcmp(prop, SINK_CLASS) != 0)
-        return;
-    if (info->card != self->card_id || self->sink_id != -1)
-        return;
+    guint i;
 
-    self->sink_id = info->index;
+    for (i = 0; i < dev->ports->len; i++) {
+        const CadPulsePort *port = &g_array_index(dev->ports, CadPulsePort, i);
 
-#ifdef WITH_DROID_SUPPORT
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
-    self->sink_is_droid = (prop && strcmp(prop, DROID_API_NAME) == 0);
-#endif /* WITH_DROID_SUPPORT */
+        if (port->classes & classes)
+            return port->index;
+    }
 
-    g_debug("SINK: idx=%u name='%s'", info->index, info->name);
+    return -1;
+}
 
-    process_sink_ports(self, info);
+static void device_clear_ports(CadPulseDevice *dev)
+{
+    g_array_set_size(dev->ports, 0);
+    g_ptr_array_set_size(dev->port_names, 0);
+    dev->active_port = -1;
+    dev->speaker_port = -1;
 }
 
-static void init_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+/*
+ * Port names only have to contain one of the policy's, so a port driving the
+ * speaker along with other outputs, such as droid's
+ * "output-speaker+wired_headphone", is a speaker port too: it is only used as
+ * such if there's no dedicated one. Otherwise, the highest priority one wins.
+ */
+static gboolean is_better_speaker(const CadPulseDevice *dev, const CadPulsePort *port)
 {
-    CadPulse *self = data;
+    const guint others = CAD_POLICY_PORT_EARPIECE | CAD_POLICY_PORT_HEADPHONES;
+    const CadPulsePort *current;
 
-    if (eol == 1)
-        return;
+    if (dev->speaker_port < 0)
+        return TRUE;
 
-    if (!info)
-        g_error("PA returned no source info (eol=%d)", eol);
+    current = &g_array_index(dev->ports, CadPulsePort, dev->speaker_port);
+    if (!(current->classes & others) != !(port->classes & others))
+        return !(port->classes & others);
 
-    process_new_source(self, info);
+    return port->priority > current->priority;
 }
 
-static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+static void device_add_port(CadPulseDevice *dev, const gchar *name,
+                            guint32 priority, int available)
 {
-    CadPulse *self = data;
+    CadPulsePort port;
 
-    if (eol == 1)
-        return;
+    port.index = dev->port_names->len;
+    port.classes = cad_policy_classify_port(name);
+    port.priority = priority;
+    port.available = available;
 
-    if (!info)
-        g_error("PA returned no sink info (eol=%d)", eol);
+    if ((port.classes & CAD_POLICY_PORT_SPEAKER) && is_better_speaker(dev, &port))
+        dev->speaker_port = port.index;
 
-    process_new_sink(self, info);
+    g_array_append_val(dev->ports, port);
+    g_ptr_array_add(dev->port_names, g_strdup(name));
 }
 
-static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+/*
+ * Whether the cached port @name is missing or has a different availability
+ */
+static gboolean port_changed(const CadPulseDevice *dev, const gchar *name, int available)
 {
-    CadPulse *self = data;
-    const gchar *prop;
-    guint i;
-
-    if (eol == 1)
-        return;
-
-    if (!info)
-        g_error("PA returned no card info (eol=%d)", eol);
-
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_BUS_PATH);
-    if (prop && strcmp(prop, CARD_BUS_PATH) != 0)
-        return;
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_FORM_FACTOR);
-    if (prop && strcmp(prop, CARD_FORM_FACTOR) != 0)
-        return;
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
-    if (prop && strcmp(prop, CARD_MODEM_CLASS) == 0)
-        return;
+    gint port = find_port(dev, name);
 
-    self->card_id = info->index;
+    return port < 0 || g_array_index(dev->ports, CadPulsePort, port).available != available;
+}
 
-    g_debug("CARD: idx=%u name='%s'", info->index, info->name);
+/*
+ * The cache_*_info() functions return whether the availability of the
+ * device's ports changed.
+ */
+static gboolean cache_sink_info(CadPulseDevice *sink, const pa_sink_info *info)
+{
+    gboolean changed = (info->n_ports != sink->ports->len);
+    guint i;
 
-    for (i = 0; i < info->n_profiles; i++) {
-        pa_card_profile_info2 *profile = info->profiles2[i];
+    for (i = 0; i < info->n_ports && !changed; i++)
+        changed = port_changed(sink, info->ports[i]->name, info->ports[i]->available);
 
-#ifdef WITH_DROID_SUPPORT
-        if (strstr(profile->name, SND_USE_CASE_VERB_VOICECALL) != NULL || strstr(profile->name, DROID_PROFILE_VOICECALL) != NULL) {
-#else
-        if (strstr(profile->name, SND_USE_CASE_VERB_VOICECALL) != NULL) {
-#endif /* WITH_DROID_SUPPORT */
-            self->has_voice_profile = TRUE;
-            break;
-        }
+    device_clear_ports(sink);
+    for (i = 0; i < info->n_ports; i++) {
+        pa_sink_port_info *port = info->ports[i];
+        device_add_port(sink, port->name, port->priority, port->available);
     }
 
-    g_debug("CARD:   %s voice profile", self->has_voice_profile ? "has" : "doesn't have");
+    sink->active_port = find_port(sink, info->active_port ? info->active_port->name : NULL);
+    sink->mute = !!info->mute;
+
+    return changed;
 }
 
-static void init_cards_list(CadPulse *self)
+static gboolean cache_source_info(CadPulseDevice *source, const pa_source_info *info)
 {
-    pa_operation *op;
+    gboolean changed = (info->n_ports != source->ports->len);
+    guint i;
 
-    self->card_id = self->sink_id = self->source_id = -1;
+    for (i = 0; i < info->n_ports && !changed; i++)
+        changed = port_changed(source, info->ports[i]->name, info->ports[i]->available);
 
-    op = pa_context_get_card_info_list(self->ctx, init_card_info, self);
-    pa_operation_unref(op);
-    op = pa_context_get_sink_info_list(self->ctx, init_sink_info, self);
-    pa_operation_unref(op);
-    op = pa_context_get_source_info_list(self->ctx, init_source_info, self);
-    pa_operation_unref(op);
-}
+    device_clear_ports(source);
+    for (i = 0; i < info->n_ports; i++) {
+        pa_source_port_info *port = info->ports[i];
+        device_add_port(source, port->name, port->priority, port->available);
+    }
 
-static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint32_t idx, void *data)
-{
-    CadPulse *self = data;
-    pa_subscription_event_type_t kind = type & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
-    pa_operation *op = NULL;
+    source->active_port = find_port(source, info->active_port ? info->active_port->name : NULL);
+    source->mute = !!info->mute;
 
-    switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
-    case PA_SUBSCRIPTION_EVENT_SINK:
-        if (idx == self->sink_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
-            g_debug("sink %u removed", idx);
-            self->sink_id = -1;
-        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
-            g_debug("new sink %u", idx);
-            op = pa_context_get_sink_info_by_index(ctx, idx, init_sink_info, self);
-            pa_operation_unref(op);
-        }
-        break;
-    case PA_SUBSCRIPTION_EVENT_SOURCE:
-        if (idx == self->source_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
-            g_debug("source %u removed", idx);
-            self->source_id = -1;
-        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
-            g_debug("new sink %u", idx);
-            op = pa_context_get_source_info_by_index(ctx, idx, init_source_info, self);
-            pa_operation_unref(op);
-        }
-        break;
-    default:
-        break;
-    }
+    return changed;
 }
 
-static void subscribe_cb(pa_context *ctx, int success, void *data)
+static guint card_rank(const CadPulseCard *card, const pa_card_info *info)
 {
-    g_debug("subscribe returned %d", success);
+    CadPolicyCardClass card_class;
+    guint rank;
+
+    card_class = cad_policy_classify_card(pa_proplist_gets(info->proplist, PA_PROP_DEVICE_BUS_PATH),
+                                          pa_proplist_gets(info->proplist, PA_PROP_DEVICE_FORM_FACTOR),
+                                          pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS));
+
+    if (card_class == CAD_POLICY_CARD_IGNORED)
+        return CARD_RANK_NONE;
+
+    /* Whatever the form factor, a Bluetooth device supporting HFP is a headset */
+    if (card->is_bluez)
+        rank = card->call_profile ? CARD_RANK_HEADSET : CARD_RANK_NONE;
+    else if (card_class == CAD_POLICY_CARD_HEADSET)
+        rank = CARD_RANK_HEADSET;
+    else if (card_class == CAD_POLICY_CARD_INTERNAL)
+        rank = CARD_RANK_INTERNAL;
+    else
+        rank = CARD_RANK_OTHER;
+
+    if (rank != CARD_RANK_NONE && card->has_voice_profile)
+        rank += CARD_RANK_VOICE_PROFILE_BONUS;
+
+    return rank;
 }
 
-static void pulse_state_cb(pa_context *ctx, void *data)
+/*
+ * Available profile of the given kind with the highest priority
+ */
+static const gchar *find_profile(const pa_card_info *info, CadPolicyProfile kind)
 {
-    CadPulse *self = data;
-    pa_context_state_t state;
+    pa_card_profile_info2 *best = NULL;
+    guint i;
 
-    state = pa_context_get_state(ctx);
-    switch (state) {
-    case PA_CONTEXT_UNCONNECTED:
-    case PA_CONTEXT_CONNECTING:
-    case PA_CONTEXT_AUTHORIZING:
-    case PA_CONTEXT_SETTING_NAME:
-        g_debug("PA not ready");
-        break;
-    case PA_CONTEXT_FAILED:
-        g_error("Error in PulseAudio context: %s", pa_strerror(pa_context_errno(ctx)));
-        break;
-    case PA_CONTEXT_TERMINATED:
-    case PA_CONTEXT_READY:
-        pa_context_set_state_callback(ctx, NULL, NULL);
-        pa_context_set_subscribe_callback(ctx, changed_cb, self);
-        pa_context_subscribe(ctx,
-                             PA_SUBSCRIPTION_MASK_SINK  | PA_SUBSCRIPTION_MASK_SOURCE,
-                             subscribe_cb, self);
-        g_debug("PA is ready, initializing cards list");
-        init_cards_list(self);
-        break;
+    for (i = 0; i < info->n_profiles; i++) {
+        pa_card_profile_info2 *profile = info->profiles2[i];
+
+        if (profile->available && cad_policy_match_profile(profile->name, kind) &&
+            (!best || profile->priority > best->priority))
+            best = profile;
     }
+
+    return best ? best->name : NULL;
 }
 
-static void constructed(GObject *object)
+static void cache_card_info(CadPulseCard *card, const pa_card_info *info)
 {
-    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
-    CadPulse *self = CAD_PULSE(object);
-    pa_proplist *props;
-    int err;
-
-    /* Meta data */
-    props = pa_proplist_new();
-    g_assert(props != NULL);
-
-    err = pa_proplist_sets(props, PA_PROP_APPLICATION_NAME, APPLICATION_NAME);
-    err = pa_proplist_sets(props, PA_PROP_APPLICATION_ID, APPLICATION_ID);
+    const gchar *prop;
 
-    self->loop = pa_glib_mainloop_new(NULL);
-    if (!self->loop)
-        g_error ("Error creating PulseAudio main loop");
+    replace_string(&card->active_profile,
+                   info->active_profile2 ? info->active_profile2->name : NULL);
 
-    self->ctx = pa_context_new(pa_glib_mainloop_get_api(self->loop), APPLICATION_NAME);
-    if (!self->ctx)
-        g_error ("Error creating PulseAudio context");
+    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
+    card->is_bluez = (prop && strcmp(prop, BLUEZ_API_NAME) == 0);
 
-    pa_context_set_state_callback(self->ctx, (pa_context_notify_cb_t)pulse_state_cb, self);
-    err = pa_context_connect(self->ctx, NULL, PA_CONTEXT_NOFAIL, 0);
-    if (err < 0)
-        g_error ("Error connecting to PulseAudio context: %s", pa_strerror(err));
+    replace_string(&card->call_profile, find_profile(info, CAD_POLICY_PROFILE_VOICECALL));
+    replace_string(&card->media_profile, find_profile(info, CAD_POLICY_PROFILE_DEFAULT));
+    card->has_voice_profile = (card->call_profile != NULL);
 
-    parent_class->constructed(object);
+    card->rank = card_rank(card, info);
 }
 
-
-static void dispose(GObject *object)
+/*
+ * Highest priority available output port not belonging to any of the
+ * @exclude classes, or -1
+ */
+static gint get_available_output(const CadPulseDevice *sink, guint exclude)
 {
-    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
-    CadPulse *self = CAD_PULSE(object);
+    const CadPulsePort *available_port = NULL;
+    guint i;
+
+    g_debug("looking for available port excluding classes 0x%x", exclude);
+
+    for (i = 0; i < sink->ports->len; i++) {
+        const CadPulsePort *port = &g_array_index(sink->ports, CadPulsePort, i);
 
-    if (self->speaker_port)
-        g_free(self->speaker_port);
+        if ((port->classes & exclude) || port->available == PA_PORT_AVAILABLE_NO)
+            continue;
 
-    if (self->ctx) {
-        pa_context_disconnect(self->ctx);
-        pa_context_unref(self->ctx);
-        self->ctx = NULL;
+        if (!available_port || port->priority > available_port->priority)
+            available_port = port;
+    }
 
-        pa_glib_mainloop_free(self->loop);
-        self->loop = NULL;
+    if (available_port) {
+        g_debug("found available port '%s'", port_name(sink, available_port->index));
+        return available_port->index;
     }
 
-    parent_class->dispose(object);
+    g_warning("no available port found!");
+
+    return -1;
 }
 
-static void cad_pulse_class_init(CadPulseClass *klass)
+/*
+ * Class of input port going along with the sink's @output_port, so the mic
+ * in use is on the same device as the output: the headset mic for wired
+ * headsets, the builtin one for the earpiece and the speaker.
+ */
+static guint paired_input_class(const CadPulseDevice *sink, gint output_port)
 {
-    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    const CadPulsePort *port;
 
-    object_class->constructed = constructed;
-    object_class->dispose = dispose;
-}
+    if (!sink || output_port < 0)
+        return 0;
 
-static void cad_pulse_init(CadPulse *self)
-{
+    port = &g_array_index(sink->ports, CadPulsePort, output_port);
+    if (port->classes & CAD_POLICY_PORT_HEADPHONES)
+        return CAD_POLICY_PORT_HEADSET_MIC;
+    if (port->classes & (CAD_POLICY_PORT_SPEAKER | CAD_POLICY_PORT_EARPIECE))
+        return CAD_POLICY_PORT_BUILTIN_MIC;
+
+    return 0;
 }
 
-CadPulse *cad_pulse_get_default(void)
+static gint get_best_input(const CadPulseDevice *source, guint paired_class)
 {
-    static CadPulse *pulse = NULL;
-
-    if (pulse == NULL) {
-        g_debug("initializing pulseaudio backend...");
-        pulse = g_object_new(CAD_TYPE_PULSE, NULL);
-        g_object_add_weak_pointer(G_OBJECT(pulse), (gpointer *)&pulse);
-    }
+    /*
+     * get_best_input() works a bit differently than get_available_output():
+     *
+     * If the policy classifies some of the ports as headset or builtin mic,
+     * the input is chosen between those: the one paired with the current
+     * output if available, the headset one being preferred otherwise.
+     *
+     * If none of them is available, the mic with the highest priority gets
+     * chosen.
+    */
 
-    return pulse;
-}
+    const CadPulsePort *headset_mic = NULL;
+    const CadPulsePort *builtin_mic = NULL;
+    const CadPulsePort *available_port = NULL;
+    guint i;
 
-static void operation_complete_cb(pa_context *ctx, int success, void *data)
-{
-    CadPulseOperation *operation = data;
+    g_debug("Looking for available input port paired with classes 0x%x", paired_class);
 
-    g_debug("operation returned %d", success);
+    for (i = 0; i < source->ports->len; i++) {
+        const CadPulsePort *port = &g_array_index(source->ports, CadPulsePort, i);
 
-    if (operation) {
-        if (operation->op) {
-            operation->op->success = (gboolean)!!success;
-            operation->op->callback(operation->op);
+        if ((port->classes & CAD_POLICY_PORT_PARKING) || port->available == PA_PORT_AVAILABLE_NO)
+            continue;
 
-            if (operation->op->type == CAD_OPERATION_SELECT_MODE &&
-                operation->op->success) {
-                operation->pulse->current_mode = operation->value;
-            }
+        /* Keep the highest priority port of each class */
+        if (port->classes & CAD_POLICY_PORT_HEADSET_MIC) {
+            if (!headset_mic || port->priority > headset_mic->priority)
+                headset_mic = port;
+        } else if (port->classes & CAD_POLICY_PORT_BUILTIN_MIC) {
+            if (!builtin_mic || port->priority > builtin_mic->priority)
+                builtin_mic = port;
+        } else if (!available_port || port->priority > available_port->priority) {
+            available_port = port;
         }
+    }
 
-        free(operation);
+    if (paired_class == CAD_POLICY_PORT_BUILTIN_MIC && builtin_mic)
+        available_port = builtin_mic;
+    else if (headset_mic)
+        available_port = headset_mic;
+    else if (builtin_mic)
+        available_port = builtin_mic;
+
+    if (available_port) {
+        g_debug("found available input port '%s'", port_name(source, available_port->index));
+        return available_port->index;
     }
+    
+    g_warning("no available input port found!");
+
+    return -1;
 }
 
-#ifdef WITH_DROID_SUPPORT
-static void droid_source_parked_complete_cb(pa_context *ctx, int success, void *data)
+static gboolean card_in_call_profile(const CadPulseCard *card)
 {
-    /*
-     * Callback fired when the source parking happened. We can now actually
-     * change the output port.
-    */
-
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    return cad_policy_match_profile(card->active_profile, CAD_POLICY_PROFILE_VOICECALL);
+}
 
-    g_debug("droid: parking succeeded, setting real output port");
+/*
+ * Whether the card's devices are being replaced by a profile switch. One
+ * which never completes isn't waited for longer than a step would be.
+ */
+static gboolean card_switching_profile(const CadPulseCard *card)
+{
+    return card->switch_start &&
+           g_get_monotonic_time() - card->switch_start < WATCHDOG_MAX_TIMEOUT * 1000;
+}
 
-    op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
-                                           operation->pulse->sink_id,
-                                           set_output_port, data);
+/*
+ * Derive the exported state from the cached model, and notify the
+ * properties which changed.
+ */
+static void update_state(CadPulse *self)
+{
+    CallAudioMode audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+    CallAudioSpeakerState speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+    CallAudioMicState mic_state = CALL_AUDIO_MIC_UNKNOWN;
+    gboolean available;
+
+    /* Bluetooth devices only have a source while in a call profile */
+    available = (self->card && self->sink && (self->source || self->card->is_bluez));
+
+    if (self->card) {
+        if (!self->card->has_voice_profile)
+            audio_mode = self->current_mode;
+        else if (card_in_call_profile(self->card))
+            audio_mode = CALL_AUDIO_MODE_CALL;
+        else
+            audio_mode = CALL_AUDIO_MODE_DEFAULT;
 
-    if (op)
-        pa_operation_unref(op);
+        /* The profile may have been changed by someone else */
+        if (self->card->has_voice_profile && audio_mode != self->current_mode) {
+            g_debug("current mode is now %u", audio_mode);
+            self->current_mode = audio_mode;
+        }
 
-}
-    
-static void droid_sink_parked_complete_cb(pa_context *ctx, int success, void *data)
-{
-    /*
-     * Callback fired when the sink parking happened. We can then park
-     * the source too.
-    */
+        /* The switch back to the default mode was acknowledged already */
+        if (self->linger_id && audio_mode == CALL_AUDIO_MODE_CALL)
+            audio_mode = CALL_AUDIO_MODE_DEFAULT;
+        else if (self->hold.active && audio_mode == CALL_AUDIO_MODE_CALL)
+            audio_mode = CALL_AUDIO_MODE_HOLD;
+    }
 
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    if (self->sink) {
+        if (self->sink->speaker_port >= 0 && self->sink->active_port == self->sink->speaker_port)
+            speaker_state = CALL_AUDIO_SPEAKER_ON;
+        else
+            speaker_state = CALL_AUDIO_SPEAKER_OFF;
+    }
 
-    g_debug("droid: parking input to trigger mode change");
+    if (self->source)
+        mic_state = self->source->mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON;
 
-    op = pa_context_set_source_port_by_index(ctx, operation->pulse->source_id,
-                                            DROID_INPUT_PORT_PARKING,
-                                            droid_source_parked_complete_cb, data);
+    if (audio_mode != self->audio_mode) {
+        g_debug("audio mode changed to %u", audio_mode);
+        self->audio_mode = audio_mode;
+        g_object_notify_by_pspec(G_OBJECT(self), props[PROP_AUDIO_MODE]);
+    }
+    if (speaker_state != self->speaker_state) {
+        g_debug("speaker state changed to %u", speaker_state);
+        self->speaker_state = speaker_state;
+        g_object_notify_by_pspec(G_OBJECT(self), props[PROP_SPEAKER_STATE]);
+    }
+    if (mic_state != self->mic_state) {
+        g_debug("mic state changed to %u", mic_state);
+        self->mic_state = mic_state;
+        g_object_notify_by_pspec(G_OBJECT(self), props[PROP_MIC_STATE]);
+    }
+    if (available != self->available) {
+        g_debug("backend %s available", available ? "is" : "isn't");
+        self->available = available;
+        g_object_notify_by_pspec(G_OBJECT(self), props[PROP_AVAILABLE]);
+    }
 
-    if (op)
-        pa_operation_unref(op);
+    cad_state_update(audio_mode, speaker_state, mic_state, available,
+                     self->sink ? port_name(self->sink, self->sink->active_port) : NULL,
+                     self->source ? port_name(self->source, self->source->active_port) : NULL);
+}
 
+static gboolean in_call(CadPulse *self)
+{
+    return self->audio_mode == CALL_AUDIO_MODE_CALL || self->audio_mode == CALL_AUDIO_MODE_HOLD;
 }
 
-static void droid_mode_change_complete_cb(pa_context *ctx, int success, void *data)
+static gboolean has_requested_route(CadPulse *self)
 {
-    /*
-     * Android HAL switches modes once the next routing change happens.
-     * Thus, we need to "park" the sink/source before switching to the
-     * actual port.
-     *
-     * pulseaudio-modules-droid provides the input-parking and output-parking
-     * ports to accomplish that.
-     *
-     * It's one more step that needs to be done only on droid devices.
-    */
+    return self->requested.mode != CALL_AUDIO_MODE_UNKNOWN ||
+           self->requested.speaker != CALL_AUDIO_SPEAKER_UNKNOWN ||
+           self->requested.mic != CALL_AUDIO_MIC_UNKNOWN;
+}
 
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+/*
+ * Another card was selected for calls while running: apply the last route
+ * requested by clients to it, so e.g. an ongoing call follows a USB headset
+ * being plugged in or out.
+ */
+static void schedule_restore(CadPulse *self)
+{
+    CadOperation *op;
 
-    if (!operation->pulse->sink_is_droid)
-        return operation_complete_cb(ctx, success, data);
+    if (!self->ready || !self->card || !has_requested_route(self))
+        return;
 
-    g_debug("droid: parking output to trigger mode change");
+    g_debug("devices changed, applying the requested route again");
 
-    op = pa_context_set_sink_port_by_index(ctx, operation->pulse->sink_id,
-                                           DROID_OUTPUT_PORT_PARKING,
-                                           droid_sink_parked_complete_cb,
-                                           operation);
-    if (op)
-        pa_operation_unref(op);
+    op = g_new0(CadOperation, 1);
+    op->type = CAD_OPERATION_RESTORE;
+    op->callback = (CadOperationCallback)g_free;
+    op->received = g_get_monotonic_time();
+    cad_scheduler_push(op);
 }
 
-static void droid_output_port_change_complete_cb(pa_context *ctx, int success, void *data)
+static gboolean linger_done_cb(gpointer data)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadPulse *self = data;
 
-    g_debug("droid: setting real input port");
+    self->linger_id = 0;
 
-    op = pa_context_get_source_info_by_index(operation->pulse->ctx,
-                                           operation->pulse->source_id,
-                                           set_input_port, operation);
+    g_debug("no call requested in the meantime, switching to default mode");
+    cad_stats_record_linger(CAD_STATS_LINGER_EXPIRED);
+    schedule_restore(self);
 
-    if (op)
-        pa_operation_unref(op);
+    return G_SOURCE_REMOVE;
 }
-#endif /* WITH_DROID_SUPPORT */
 
-static void set_card_profile(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+/*
+ * Switching back and forth between the call and default profiles is the
+ * slowest thing we do, and back-to-back calls (call waiting, redialing)
+ * would pay for it each time: leaving the call profile is acknowledged
+ * right away but only done once no call was requested for a while.
+ *
+ * Returns TRUE if the switch to the default mode has been deferred.
+ */
+static gboolean start_linger(CadPulse *self)
 {
-    CadPulseOperation *operation = data;
-    pa_card_profile_info2 *profile;
-    pa_operation *op = NULL;
-    gchar *default_profile;
-    gchar *voicecall_profile;
-    pa_context_success_cb_t complete_callback;
-
-    if (eol == 1)
-        return;
+    if (linger_time == 0 || !self->card->has_voice_profile ||
+        !card_in_call_profile(self->card))
+        return FALSE;
 
-    if (!info)
-        g_error("PA returned no card info (eol=%d)", eol);
+    if (self->linger_id)
+        return TRUE;
 
-    if (info->index != operation->pulse->card_id)
-        return;
+    g_debug("deferring switch to default mode by %ums", linger_time);
+    self->linger_id = g_timeout_add(linger_time, linger_done_cb, self);
+    cad_stats_record_linger(CAD_STATS_LINGER_DEFERRED);
 
-#ifdef WITH_DROID_SUPPORT
-    default_profile = operation->pulse->sink_is_droid ?
-                          DROID_PROFILE_HIFI :
-                          SND_USE_CASE_VERB_HIFI;
-    voicecall_profile = operation->pulse->sink_is_droid ?
-                            DROID_PROFILE_VOICECALL :
-                            SND_USE_CASE_VERB_VOICECALL;
-    complete_callback = droid_mode_change_complete_cb;
-#else
-    default_profile = SND_USE_CASE_VERB_HIFI;
-    voicecall_profile = SND_USE_CASE_VERB_VOICECALL;
-    complete_callback = operation_complete_cb;
-#endif /* WITH_DROID_SUPPORT */
+    return TRUE;
+}
 
-    profile = info->active_profile2;
+/*
+ * A mode is being applied: the deferred switch is either not needed anymore
+ * (@mode being CALL_AUDIO_MODE_CALL), or done right now.
+ */
+static void stop_linger(CadPulse *self, guint mode)
+{
+    if (!self->linger_id)
+        return;
 
-    if (strcmp(profile->name, voicecall_profile) == 0 && operation->value == 0) {
-        g_debug("switching to default profile");
-        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
-                                                  default_profile,
-                                                  complete_callback, operation);
-    } else if (strcmp(profile->name, default_profile) == 0 && operation->value == 1) {
-        g_debug("switching to voice profile");
-        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
-                                                  voicecall_profile,
-                                                  complete_callback, operation);
-    }
+    g_clear_handle_id(&self->linger_id, g_source_remove);
 
-    if (op) {
-        pa_operation_unref(op);
-    } else {
-        g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
+    if (mode == CALL_AUDIO_MODE_CALL) {
+        g_debug("call requested again, staying in call profile");
+        cad_stats_record_linger(CAD_STATS_LINGER_AVOIDED);
     }
 }
 
-static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+/*
+ * During a call, follow port availability changes (e.g. headset plugged or
+ * unplugged) without waiting for a client to ask: the ports are selected
+ * again, keeping the speaker if it was explicitly enabled.
+ */
+static void schedule_reroute(CadPulse *self)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
-    const gchar *target_port;
-    pa_context_success_cb_t complete_callback;
-
-#ifdef WITH_DROID_SUPPORT
-    complete_callback = droid_output_port_change_complete_cb;
-#else
-    complete_callback = operation_complete_cb;
-#endif
+    CadOperation *op;
 
-    if (eol == 1)
+    if (!in_call(self))
         return;
 
-    if (!info)
-        g_error("PA returned no sink info (eol=%d)", eol);
+    g_debug("port availability changed during call, rerouting");
 
-    if (info->card != operation->pulse->card_id || info->index != operation->pulse->sink_id)
-        return;
+    op = g_new0(CadOperation, 1);
+    op->type = CAD_OPERATION_REROUTE;
+    op->callback = (CadOperationCallback)g_free;
+    op->received = g_get_monotonic_time();
+    cad_scheduler_push(op);
+}
 
-    if (operation->op->type == CAD_OPERATION_SELECT_MODE) {
-        /*
-         * When switching to voice call mode, we want to switch to any port
-         * other than the speaker; this makes sure we use the headphones if they
-         * are connected, and the earpiece otherwise.
-         * When switching back to normal mode, the highest priority port is to
-         * be selected anyway.
-         */
-        if (operation->value == CALL_AUDIO_MODE_CALL)
-            target_port = get_available_output(info, operation->pulse->speaker_port);
-        else
-            target_port = get_available_output(info, NULL);
-    } else {
-        /*
-         * When forcing speaker output, we simply select the speaker port.
-         * When disabling speaker output, we want the highest priority port
-         * other than the speaker, so that we use the headphones if connected,
-         * and the earpiece otherwise.
-         */
-        if (operation->value)
-            target_port = operation->pulse->speaker_port;
-        else
-            target_port = get_available_output(info, operation->pulse->speaker_port);
-    }
+/*
+ * First sink or source (by index) belonging to @card
+ */
+static CadPulseDevice *find_card_device(GHashTable *devices, guint32 card)
+{
+    CadPulseDevice *found = NULL;
+    GHashTableIter iter;
+    gpointer value;
 
-    g_debug("active port is '%s', target port is '%s'", info->active_port->name, target_port);
+    g_hash_table_iter_init(&iter, devices);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseDevice *dev = value;
 
-    if (strcmp(info->active_port->name, target_port) != 0) {
-        g_debug("switching to target port '%s'", target_port);
-        op = pa_context_set_sink_port_by_index(ctx, operation->pulse->sink_id,
-                                               target_port,
-                                               complete_callback, operation);
+        if (dev->card == card && (!found || dev->index < found->index))
+            found = dev;
     }
 
-    if (op) {
-        pa_operation_unref(op);
-    } else {
-        g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
-    }
+    return found;
 }
 
-static void set_input_port(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+/*
+ * Operations only act on the card used for calls: when another one gets
+ * selected, the previous one is switched out of its call profile right away
+ * so it doesn't stay there once the call is over.
+ */
+static void release_card(CadPulse *self, CadPulseCard *card)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
-    const gchar *target_port;
-
-    if (eol == 1)
-        return;
-
-    if (!info)
-        g_error("PA returned no source info (eol=%d)", eol);
+    const gchar *default_profile = card->media_profile;
+    pa_operation *op;
 
-    if (info->card != operation->pulse->card_id || info->index != operation->pulse->source_id)
+    if (!self->ctx || !default_profile || !card_in_call_profile(card))
         return;
 
-#ifdef WITH_DROID_SUPPORT
-    target_port = get_best_input(info, operation->pulse->source_is_droid);
-#else
-    target_port = get_best_input(info, false);
-#endif
-
-    g_debug("active source port is '%s', target source port is '%s'", info->active_port->name, target_port);
-
-    if (strcmp(info->active_port->name, target_port) != 0) {
-        g_debug("switching to target source port '%s'", target_port);
-        op = pa_context_set_source_port_by_index(ctx, operation->pulse->source_id,
-                                                 target_port,
-                                                 operation_complete_cb, operation);
-    }
+    g_debug("CARD: idx=%u no longer used, switching to '%s'", card->index, default_profile);
 
+    op = pa_context_set_card_profile_by_index(self->ctx, card->index, default_profile,
+                                              NULL, NULL);
     if (op) {
         pa_operation_unref(op);
-    } else {
-        g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
+        replace_string(&card->active_profile, default_profile);
     }
 }
 
-static void set_mic_mute(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+/*
+ * Forget the hold when other devices are selected for calls, or PA went
+ * away: the requested route is applied to the new devices without it. The
+ * held ones get their mute state back when it is (see add_release_steps()),
+ * and are known by name as PA restarting changes their index.
+ */
+static void drop_hold(CadPulse *self)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
-
-    if (eol == 1)
-        return;
-
-    if (!info)
-        g_error("PA returned no source info (eol=%d)", eol);
-
-    if (info->card != operation->pulse->card_id || info->index != operation->pulse->source_id)
+    if (!self->hold.active)
         return;
 
-    if (info->mute && !operation->value) {
-        g_debug("mic is muted, unmuting...");
-        op = pa_context_set_source_mute_by_index(ctx, operation->pulse->source_id, 0,
-                                                 operation_complete_cb, operation);
-    } else if (!info->mute && operation->value) {
-        g_debug("mic is active, muting...");
-        op = pa_context_set_source_mute_by_index(ctx, operation->pulse->source_id, 1,
-                                                 operation_complete_cb, operation);
-    }
+    g_debug("dropping hold");
+    self->hold.active = FALSE;
 
-    if (op) {
-        pa_operation_unref(op);
-    } else {
-        g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
-    }
+    g_free(self->hold.sink_name);
+    self->hold.sink_name = self->sink ? g_strdup(self->sink->name) : NULL;
+    g_free(self->hold.source_name);
+    self->hold.source_name = self->source ? g_strdup(self->source->name) : NULL;
 }
 
-void cad_pulse_select_mode(guint mode, CadOperation *cad_op)
+static void discard_plan(CadPulse *self)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
-    pa_operation *op = NULL;
-
-    if (!cad_op) {
-        g_critical("%s: no callaudiod operation", __func__);
-        goto error;
-    }
-    if (!operation) {
-        g_critical("%s: unable to allocate memory", __func__);
-        goto error;
-    }
+    if (self->plan.valid)
+        g_debug("discarding prepared call plan");
 
-    /*
-     * Make sure cad_op is of the correct type!
-     */
-    g_assert(cad_op->type == CAD_OPERATION_SELECT_MODE);
+    memset(&self->plan, 0, sizeof(self->plan));
+}
 
-    operation->pulse = cad_pulse_get_default();
-    operation->op = cad_op;
-    operation->value = mode;
+/*
+ * Pick the devices used for calls: the best ranked card which has both a
+ * sink and a source, or failing that the best ranked card at all. Ties go
+ * to the card PA knew about first.
+ *
+ * Bluetooth devices only get a source once switched to their call profile,
+ * but can be used all the same. They are skipped while the speaker is
+ * requested, as it is the phone's own. Likewise, a card switching profile
+ * isn't left aside while its new devices are on their way.
+ */
+static void select_devices(CadPulse *self)
+{
+    CadPulseCard *card = NULL;
+    CadPulseDevice *sink = NULL;
+    CadPulseDevice *source = NULL;
+    gboolean complete = FALSE;
+    gboolean changed;
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, self->cards);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseCard *candidate = value;
+        CadPulseDevice *candidate_sink, *candidate_source;
+        gboolean candidate_complete;
+
+        if (candidate->rank == CARD_RANK_NONE)
+            continue;
+        if (candidate->is_bluez && self->requested.speaker == CALL_AUDIO_SPEAKER_ON)
+            continue;
 
-    if (mode != CALL_AUDIO_MODE_CALL) {
-        /*
-         * When ending a call, we want to make sure the mic doesn't stay muted
-         */
-        CadPulseOperation *unmute_op = g_new0(CadPulseOperation, 1);
+        candidate_sink = find_card_device(self->sinks, candidate->index);
+        candidate_source = find_card_device(self->sources, candidate->index);
+        candidate_complete = (candidate_sink && candidate_source) || candidate->is_bluez ||
+                             card_switching_profile(candidate);
 
-        unmute_op->pulse = operation->pulse;
-        unmute_op->value = FALSE;
+        if (card && (complete > candidate_complete ||
+                     (complete == candidate_complete &&
+                      (card->rank > candidate->rank ||
+                       (card->rank == candidate->rank && card->index < candidate->index)))))
+            continue;
 
-        op = pa_context_get_source_info_by_index(unmute_op->pulse->ctx,
-                                                 unmute_op->pulse->source_id,
-                                                 set_mic_mute, unmute_op);
-        pa_operation_unref(op);
+        card = candidate;
+        sink = candidate_sink;
+        source = candidate_source;
+        complete = candidate_complete;
     }
 
-    if (operation->pulse->has_voice_profile) {
-        g_debug("card has voice profile, using it");
-        op = pa_context_get_card_info_by_index(operation->pulse->ctx,
-                                               operation->pulse->card_id,
-                                               set_card_profile, operation);
-    } else {
-        g_debug("card doesn't have voice profile, switching output port");
-        op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
-                                               operation->pulse->sink_id,
-                                               set_output_port, operation);
+    changed = (card != self->card || sink != self->sink || source != self->source);
+    if (changed) {
+        g_debug("using card %d, sink %d, source %d",
+                card ? (gint)card->index : -1,
+                sink ? (gint)sink->index : -1,
+                source ? (gint)source->index : -1);
+
+        if (self->card && self->card != card)
+            release_card(self, self->card);
+        drop_hold(self);
+
+        self->card = card;
+        self->sink = sink;
+        self->source = source;
+        discard_plan(self);
     }
 
-    if (op)
-        pa_operation_unref(op);
-
-    return;
+    update_state(self);
 
-error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        cad_op->callback(cad_op);
-    }
-    if (operation)
-        free(operation);
+    if (changed)
+        schedule_restore(self);
 }
 
-void cad_pulse_enable_speaker(gboolean enable, CadOperation *cad_op)
+/*
+ * Drop @dev from the selection if needed, before it gets freed. The
+ * selection itself is updated by the caller.
+ */
+static void forget_device(CadPulse *self, CadPulseDevice *dev)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
-    pa_operation *op = NULL;
+    if (dev == self->sink)
+        self->sink = NULL;
+    else if (dev == self->source)
+        self->source = NULL;
+}
 
-    if (!cad_op) {
-        g_critical("%s: no callaudiod operation", __func__);
-        goto error;
-    }
-    if (!operation) {
-        g_critical("%s: unable to allocate memory", __func__);
-        goto error;
-    }
+static void remove_device(CadPulse *self, GHashTable *devices, CadPulseDevice *dev)
+{
+    forget_device(self, dev);
+    g_hash_table_remove(devices, GUINT_TO_POINTER(dev->index));
+}
 
-    /*
-     * Make sure cad_op is of the correct type!
-     */
-    g_assert(cad_op->type == CAD_OPERATION_ENABLE_SPEAKER);
+static void remove_card_devices(CadPulse *self, GHashTable *devices, guint32 card)
+{
+    GHashTableIter iter;
+    gpointer value;
 
-    operation->pulse = cad_pulse_get_default();
+    g_hash_table_iter_init(&iter, devices);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseDevice *dev = value;
 
-    if (operation->pulse->sink_id < 0) {
-        g_warning("card has no usable sink");
-        goto error;
+        if (dev->card == card) {
+            forget_device(self, dev);
+            g_hash_table_iter_remove(&iter);
+        }
     }
+}
 
-    operation->op = cad_op;
-    operation->value = (guint)enable;
-
-    op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
-                                           operation->pulse->sink_id,
-                                           set_output_port, operation);
-    pa_operation_unref(op);
+static void remove_card(CadPulse *self, CadPulseCard *card)
+{
+    /* Its devices should be removed first, but don't rely on it */
+    remove_card_devices(self, self->sinks, card->index);
+    remove_card_devices(self, self->sources, card->index);
 
-    return;
+    if (card == self->card)
+        self->card = NULL;
+    g_hash_table_remove(self->cards, GUINT_TO_POINTER(card->index));
+}
 
-error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        cad_op->callback(cad_op);
-    }
-    if (operation)
-        free(operation);
+static void clear_devices(CadPulse *self)
+{
+    drop_hold(self);
+    self->card = NULL;
+    self->sink = NULL;
+    self->source = NULL;
+    discard_plan(self);
+
+    g_hash_table_remove_all(self->sinks);
+    g_hash_table_remove_all(self->sources);
+    g_hash_table_remove_all(self->cards);
+    g_hash_table_remove_all(self->sink_inputs);
+    g_hash_table_remove_all(self->source_outputs);
 }
 
-void cad_pulse_mute_mic(gboolean mute, CadOperation *cad_op)
+/*
+ * PA acknowledges Bluetooth and UCM profile switches long before they're
+ * usable: the switch is only complete once the devices for the new profile
+ * exist. This being the slowest part of routing a call, the duration of
+ * Bluetooth ones is recorded with the step statistics.
+ *
+ * Returns TRUE if the switch just completed.
+ */
+static gboolean check_profile_switch(CadPulse *self, guint32 index)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
-    pa_operation *op = NULL;
+    CadPulseCard *card = g_hash_table_lookup(self->cards, GUINT_TO_POINTER(index));
+    gint64 duration;
 
-    if (!cad_op) {
-        g_critical("%s: no callaudiod operation", __func__);
-        goto error;
-    }
-    if (!operation) {
-        g_critical("%s: unable to allocate memory", __func__);
-        goto error;
-    }
+    if (!card || !card->switch_start)
+        return FALSE;
 
-    /*
-     * Make sure cad_op is of the correct type!
-     */
-    g_assert(cad_op->type == CAD_OPERATION_MUTE_MIC);
+    if (!find_card_device(self->sinks, card->index) ||
+        (card_in_call_profile(card) && !find_card_device(self->sources, card->index)))
+        return FALSE;
 
-    operation->pulse = cad_pulse_get_default();
+    duration = g_get_monotonic_time() - card->switch_start;
+    card->switch_start = 0;
 
-    if (operation->pulse->source_id < 0) {
-        g_warning("card has no usable source");
-        goto error;
-    }
+    g_debug("CARD: idx=%u switched to '%s' in %" G_GINT64_FORMAT "us",
+            card->index, card->active_profile, duration);
+    if (card->is_bluez)
+        cad_stats_record_step(BLUEZ_SWITCH_STAT, duration);
 
-    operation->op = cad_op;
-    operation->value = (guint)mute;
+    return TRUE;
+}
 
-    op = pa_context_get_source_info_by_index(operation->pulse->ctx,
-                                             operation->pulse->source_id,
-                                             set_mic_mute, operation);
-    pa_operation_unref(op);
+static void resume_waiting_steps(CadPulse *self, guint32 card);
 
-    return;
+static void process_new_source(CadPulse *self, const pa_source_info *info)
+{
+    CadPulseDevice *source;
+    gboolean switched = FALSE;
+    const gchar *prop;
+
+    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
+    if (prop && strcmp(prop, SINK_CLASS) != 0)
+        return;
+
+    source = g_hash_table_lookup(self->sources, GUINT_TO_POINTER(info->index));
+    if (!source) {
+        source = device_new(info->index, info->name);
+        source->card = info->card;
+
+#ifdef WITH_DROID_SUPPORT
+        prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
+        source->is_droid = (prop && strcmp(prop, DROID_API_NAME) == 0);
+#endif /* WITH_DROID_SUPPORT */
+
+        g_hash_table_insert(self->sources, GUINT_TO_POINTER(info->index), source);
+        g_debug("SOURCE: idx=%u card=%u name='%s'", info->index, info->card, info->name);
+
+        /* Devices being there before the switch don't tell it's complete */
+        switched = check_profile_switch(self, info->card);
+    }
+
+    cache_source_info(source, info);
+
+    select_devices(self);
+    if (switched)
+        resume_waiting_steps(self, info->card);
+}
+
+static void process_new_sink(CadPulse *self, const pa_sink_info *info)
+{
+    CadPulseDevice *sink;
+    gboolean switched = FALSE;
+    const gchar *prop;
+
+    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
+    if (prop && strcmp(prop, SINK_CLASS) != 0)
+        return;
+
+    sink = g_hash_table_lookup(self->sinks, GUINT_TO_POINTER(info->index));
+    if (!sink) {
+        sink = device_new(info->index, info->name);
+        sink->card = info->card;
+
+#ifdef WITH_DROID_SUPPORT
+        prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
+        sink->is_droid = (prop && strcmp(prop, DROID_API_NAME) == 0);
+#endif /* WITH_DROID_SUPPORT */
+
+        g_hash_table_insert(self->sinks, GUINT_TO_POINTER(info->index), sink);
+        g_debug("SINK: idx=%u card=%u name='%s'", info->index, info->card, info->name);
+
+        switched = check_profile_switch(self, info->card);
+    }
+
+    cache_sink_info(sink, info);
+
+    select_devices(self);
+    if (switched)
+        resume_waiting_steps(self, info->card);
+}
+
+static void init_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info) {
+        if (eol < 0)
+            g_warning("Unable to get source info: %s", pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    process_new_source(self, info);
+}
+
+static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info) {
+        if (eol < 0)
+            g_warning("Unable to get sink info: %s", pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    process_new_sink(self, info);
+}
+
+/*
+ * Track stream @index, connected to @device, if it has the phone role; it is
+ * forgotten otherwise. Returns whether the stream is tracked.
+ */
+static gboolean cache_stream(GHashTable *streams, uint32_t index, uint32_t device,
+                             pa_proplist *proplist)
+{
+    const gchar *role = pa_proplist_gets(proplist, PA_PROP_MEDIA_ROLE);
+    CadPulseStream *stream;
+
+    if (!role || strcmp(role, PHONE_ROLE) != 0) {
+        g_hash_table_remove(streams, GUINT_TO_POINTER(index));
+        return FALSE;
+    }
+
+    stream = g_hash_table_lookup(streams, GUINT_TO_POINTER(index));
+    if (!stream) {
+        stream = g_new0(CadPulseStream, 1);
+        stream->index = index;
+        g_hash_table_insert(streams, GUINT_TO_POINTER(index), stream);
+    }
+    stream->device = device;
+
+    return TRUE;
+}
+
+static void process_sink_input(CadPulse *self, const pa_sink_input_info *info, gboolean is_new)
+{
+    if (!cache_stream(self->sink_inputs, info->index, info->sink, info->proplist))
+        return;
+
+    g_debug("SINK INPUT: idx=%u sink=%u", info->index, info->sink);
+
+    /* Phone streams started during a call join it */
+    if (is_new && self->sink && info->sink != self->sink->index)
+        schedule_reroute(self);
+}
+
+static void process_source_output(CadPulse *self, const pa_source_output_info *info,
+                                  gboolean is_new)
+{
+    if (!cache_stream(self->source_outputs, info->index, info->source, info->proplist))
+        return;
+
+    g_debug("SOURCE OUTPUT: idx=%u source=%u", info->index, info->source);
+
+    if (is_new && self->source && info->source != self->source->index)
+        schedule_reroute(self);
+}
+
+static void sink_input_info_cb(pa_context *ctx, const pa_sink_input_info *info, int eol, void *data)
+{
+    if (eol != 0 || !info)
+        return;
+
+    process_sink_input(data, info, FALSE);
+}
+
+static void new_sink_input_cb(pa_context *ctx, const pa_sink_input_info *info, int eol, void *data)
+{
+    if (eol != 0 || !info)
+        return;
+
+    process_sink_input(data, info, TRUE);
+}
+
+static void source_output_info_cb(pa_context *ctx, const pa_source_output_info *info,
+                                  int eol, void *data)
+{
+    if (eol != 0 || !info)
+        return;
+
+    process_source_output(data, info, FALSE);
+}
+
+static void new_source_output_cb(pa_context *ctx, const pa_source_output_info *info,
+                                 int eol, void *data)
+{
+    if (eol != 0 || !info)
+        return;
+
+    process_source_output(data, info, TRUE);
+}
+
+static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    CadPulseCard *card;
+
+    if (eol != 0 || !info) {
+        if (eol < 0)
+            g_warning("Unable to get card info: %s", pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    card = g_hash_table_lookup(self->cards, GUINT_TO_POINTER(info->index));
+    if (!card) {
+        card = g_new0(CadPulseCard, 1);
+        card->index = info->index;
+        g_hash_table_insert(self->cards, GUINT_TO_POINTER(info->index), card);
+    }
+
+    cache_card_info(card, info);
+
+    g_debug("CARD: idx=%u name='%s' rank=%u", info->index, info->name, card->rank);
+    g_debug("CARD:   %s voice profile", card->has_voice_profile ? "has" : "doesn't have");
+
+    select_devices(self);
+}
+
+static void refresh_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    CadPulseDevice *source;
+    gboolean ports_changed;
+
+    if (eol == 1 || !info)
+        return;
+
+    source = g_hash_table_lookup(self->sources, GUINT_TO_POINTER(info->index));
+    if (!source)
+        return;
+
+    ports_changed = cache_source_info(source, info);
+    g_debug("SOURCE: idx=%u refreshed, active port '%s', mute=%d",
+            info->index, port_name(source, source->active_port), source->mute);
+
+    if (source != self->source)
+        return;
+
+    update_state(self);
+
+    if (ports_changed) {
+        discard_plan(self);
+        schedule_reroute(self);
+    }
+}
+
+static void refresh_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    CadPulseDevice *sink;
+    gboolean ports_changed;
+
+    if (eol == 1 || !info)
+        return;
+
+    sink = g_hash_table_lookup(self->sinks, GUINT_TO_POINTER(info->index));
+    if (!sink)
+        return;
+
+    ports_changed = cache_sink_info(sink, info);
+    g_debug("SINK: idx=%u refreshed, active port '%s'",
+            info->index, port_name(sink, sink->active_port));
+
+    if (sink != self->sink)
+        return;
+
+    update_state(self);
+
+    if (ports_changed) {
+        discard_plan(self);
+        schedule_reroute(self);
+    }
+}
+
+static void refresh_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    CadPulseCard *card;
+
+    if (eol == 1 || !info)
+        return;
+
+    card = g_hash_table_lookup(self->cards, GUINT_TO_POINTER(info->index));
+    if (!card)
+        return;
+
+    cache_card_info(card, info);
+    g_debug("CARD: idx=%u refreshed, active profile '%s'", info->index, card->active_profile);
+
+    /* The rank depends on the card's profiles */
+    select_devices(self);
+}
+
+static pa_operation *query_object(CadPulse *self, guint facility, uint32_t idx)
+{
+    pa_operation *op = NULL;
+
+    switch (facility) {
+    case PA_SUBSCRIPTION_EVENT_CARD:
+        op = pa_context_get_card_info_by_index(self->ctx, idx, refresh_card_info, self);
+        break;
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        op = pa_context_get_sink_info_by_index(self->ctx, idx, refresh_sink_info, self);
+        break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+        op = pa_context_get_source_info_by_index(self->ctx, idx, refresh_source_info, self);
+        break;
+    default:
+        break;
+    }
+
+    return op;
+}
+
+/*
+ * Re-read a known object from PA.
+ */
+static void refresh_object(CadPulse *self, guint facility, uint32_t idx)
+{
+    pa_operation *op = query_object(self, facility, idx);
+
+    if (op)
+        pa_operation_unref(op);
+}
+
+/*
+ * Re-read the devices in use, when a write we already applied to the cache
+ * turns out to have failed.
+ */
+static void resync_cache(CadPulse *self)
+{
+    if (!self->ctx || pa_context_get_state(self->ctx) != PA_CONTEXT_READY)
+        return;
+
+    if (self->card)
+        refresh_object(self, PA_SUBSCRIPTION_EVENT_CARD, self->card->index);
+    if (self->sink)
+        refresh_object(self, PA_SUBSCRIPTION_EVENT_SINK, self->sink->index);
+    if (self->source)
+        refresh_object(self, PA_SUBSCRIPTION_EVENT_SOURCE, self->source->index);
+}
+
+static void set_ready(CadPulse *self, gboolean ready)
+{
+    if (ready == self->ready)
+        return;
+
+    g_debug("backend %s ready", ready ? "is" : "isn't");
+    self->ready = ready;
+    g_object_notify_by_pspec(G_OBJECT(self), props[PROP_READY]);
+}
+
+static void restore_done_cb(CadOperation *op)
+{
+    CadPulse *self = cad_pulse_get_default();
+    gboolean current = (op == self->restore_op);
+
+    g_debug("route restored (success=%d)", op->success);
+    g_free(op);
+
+    /* The connection may have been lost again in the meantime */
+    if (current) {
+        self->restore_op = NULL;
+        set_ready(self, TRUE);
+    }
+}
+
+/*
+ * Reapply the last requested route once the model has been rebuilt, so a PA
+ * restart doesn't silently drop us out of an ongoing call. New requests are
+ * only executed once this is done.
+ */
+static void restore_route(CadPulse *self)
+{
+    if (!has_requested_route(self)) {
+        set_ready(self, TRUE);
+        return;
+    }
+
+    g_debug("restoring route: mode=%u speaker=%u mic=%u", self->requested.mode,
+            self->requested.speaker, self->requested.mic);
+
+    self->restore_op = g_new0(CadOperation, 1);
+    self->restore_op->type = CAD_OPERATION_RESTORE;
+    self->restore_op->received = g_get_monotonic_time();
+    self->restore_op->callback = restore_done_cb;
+    cad_pulse_restore(self->restore_op);
+}
+
+static void discovery_state_cb(pa_operation *op, void *data)
+{
+    CadPulse *self = data;
+
+    if (pa_operation_get_state(op) != PA_OPERATION_DONE)
+        return;
+
+    if (--self->discovery_pending > 0)
+        return;
+
+    g_debug("discovery complete");
+    restore_route(self);
+}
+
+static void discover(CadPulse *self, pa_operation *op)
+{
+    if (!op) {
+        g_warning("Unable to query PA: %s", pa_strerror(pa_context_errno(self->ctx)));
+        return;
+    }
+
+    self->discovery_pending++;
+    pa_operation_set_state_callback(op, discovery_state_cb, self);
+    pa_operation_unref(op);
+}
+
+static void init_cards_list(CadPulse *self)
+{
+    clear_devices(self);
+
+    self->discovery_pending = 0;
+    discover(self, pa_context_get_card_info_list(self->ctx, init_card_info, self));
+    discover(self, pa_context_get_sink_info_list(self->ctx, init_sink_info, self));
+    discover(self, pa_context_get_source_info_list(self->ctx, init_source_info, self));
+    discover(self, pa_context_get_sink_input_info_list(self->ctx, sink_input_info_cb, self));
+    discover(self, pa_context_get_source_output_info_list(self->ctx, source_output_info_cb, self));
+}
+
+static void queue_event(CadPulse *self, guint facility, guint kind, uint32_t idx);
+
+/*
+ * Events on a card's devices may not be sent when only the availability of
+ * their ports changes (e.g. headset plugged in): that's only notified on the
+ * card, so its devices are refreshed along with it.
+ */
+static void queue_card_devices(CadPulse *self, guint32 card)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, self->sinks);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseDevice *dev = value;
+
+        if (dev->card == card)
+            queue_event(self, PA_SUBSCRIPTION_EVENT_SINK, PA_SUBSCRIPTION_EVENT_CHANGE, dev->index);
+    }
+
+    g_hash_table_iter_init(&iter, self->sources);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseDevice *dev = value;
+
+        if (dev->card == card)
+            queue_event(self, PA_SUBSCRIPTION_EVENT_SOURCE, PA_SUBSCRIPTION_EVENT_CHANGE, dev->index);
+    }
+}
+
+/*
+ * Apply a (coalesced) subscription event to the tables of devices, setting
+ * @reselect when the devices used for calls have to be picked again.
+ */
+static void process_event(CadPulse *self, guint facility, guint kind,
+                          uint32_t idx, gboolean *reselect)
+{
+    gpointer key = GUINT_TO_POINTER(idx);
+    pa_operation *op = NULL;
+    CadPulseDevice *dev;
+    CadPulseCard *card;
+
+    switch (facility) {
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        dev = g_hash_table_lookup(self->sinks, key);
+        if (dev && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("sink %u removed", idx);
+            remove_device(self, self->sinks, dev);
+            *reselect = TRUE;
+        } else if (dev) {
+            refresh_object(self, facility, idx);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
+            g_debug("new sink %u", idx);
+            op = pa_context_get_sink_info_by_index(self->ctx, idx, init_sink_info, self);
+        }
+        break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+        dev = g_hash_table_lookup(self->sources, key);
+        if (dev && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("source %u removed", idx);
+            remove_device(self, self->sources, dev);
+            *reselect = TRUE;
+        } else if (dev) {
+            refresh_object(self, facility, idx);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
+            g_debug("new source %u", idx);
+            op = pa_context_get_source_info_by_index(self->ctx, idx, init_source_info, self);
+        }
+        break;
+    case PA_SUBSCRIPTION_EVENT_CARD:
+        card = g_hash_table_lookup(self->cards, key);
+        if (card && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("card %u removed", idx);
+            remove_card(self, card);
+            *reselect = TRUE;
+        } else if (card) {
+            refresh_object(self, facility, idx);
+            queue_card_devices(self, idx);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
+            g_debug("new card %u", idx);
+            op = pa_context_get_card_info_by_index(self->ctx, idx, init_card_info, self);
+        }
+        break;
+    /* Only phone streams are tracked, and their role doesn't change */
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+        if (kind == PA_SUBSCRIPTION_EVENT_REMOVE)
+            g_hash_table_remove(self->sink_inputs, key);
+        else if (kind == PA_SUBSCRIPTION_EVENT_NEW)
+            op = pa_context_get_sink_input_info(self->ctx, idx, new_sink_input_cb, self);
+        else if (g_hash_table_contains(self->sink_inputs, key))
+            op = pa_context_get_sink_input_info(self->ctx, idx, sink_input_info_cb, self);
+        break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+        if (kind == PA_SUBSCRIPTION_EVENT_REMOVE)
+            g_hash_table_remove(self->source_outputs, key);
+        else if (kind == PA_SUBSCRIPTION_EVENT_NEW)
+            op = pa_context_get_source_output_info(self->ctx, idx, new_source_output_cb, self);
+        else if (g_hash_table_contains(self->source_outputs, key))
+            op = pa_context_get_source_output_info(self->ctx, idx, source_output_info_cb, self);
+        break;
+    default:
+        break;
+    }
+
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void clear_events(CadPulse *self)
+{
+    g_clear_handle_id(&self->events_id, g_source_remove);
+    g_hash_table_remove_all(self->event_index);
+    while (!g_queue_is_empty(&self->events))
+        g_free(g_queue_pop_head(&self->events));
+}
+
+static gboolean flush_events_cb(gpointer data)
+{
+    CadPulse *self = data;
+    gboolean reselect = FALSE;
+    GList *l;
+
+    g_debug("processing %u subscription events", self->events.length);
+
+    /*
+     * Events stay indexed until the whole batch is processed, so objects
+     * queued again by their card are only refreshed once.
+     */
+    for (l = self->events.head; l; l = l->next) {
+        CadPulseEvent *event = l->data;
+
+        process_event(self, event->facility, event->kind, event->idx, &reselect);
+    }
+
+    self->events_id = 0;
+    clear_events(self);
+
+    if (reselect)
+        select_devices(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_event(CadPulse *self, guint facility, guint kind, uint32_t idx)
+{
+    guint64 key = ((guint64)facility << 32) | idx;
+    CadPulseEvent *event;
+
+    event = g_hash_table_lookup(self->event_index, &key);
+    if (event) {
+        /* New or removed objects need more than a refresh */
+        if (kind != PA_SUBSCRIPTION_EVENT_CHANGE)
+            event->kind = kind;
+    } else {
+        event = g_new0(CadPulseEvent, 1);
+        event->key = key;
+        event->facility = facility;
+        event->kind = kind;
+        event->idx = idx;
+        g_queue_push_tail(&self->events, event);
+        g_hash_table_insert(self->event_index, &event->key, event);
+    }
+
+    if (!self->events_id)
+        self->events_id = g_timeout_add(EVENT_BATCH_DELAY, flush_events_cb, self);
+}
+
+/*
+ * Events come in bursts when devices are plugged or modules reloaded: they
+ * are coalesced per object and handled together once the burst is over.
+ */
+static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint32_t idx, void *data)
+{
+    queue_event(data, type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK,
+                type & PA_SUBSCRIPTION_EVENT_TYPE_MASK, idx);
+}
+
+static void subscribe_cb(pa_context *ctx, int success, void *data)
+{
+    g_debug("subscribe returned %d", success);
+}
+
+static void pulse_connect(CadPulse *self);
+static void fail_operations(CadPulse *self);
+
+static void pulse_disconnect(CadPulse *self)
+{
+    if (!self->ctx)
+        return;
+
+    pa_context_set_state_callback(self->ctx, NULL, NULL);
+    pa_context_set_subscribe_callback(self->ctx, NULL, NULL);
+    pa_context_disconnect(self->ctx);
+    pa_context_unref(self->ctx);
+    self->ctx = NULL;
+}
+
+static gboolean reconnect_cb(gpointer data)
+{
+    CadPulse *self = data;
+
+    self->reconnect_id = 0;
+    pulse_connect(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_reconnect(CadPulse *self)
+{
+    if (self->reconnect_id)
+        return;
+
+    g_debug("reconnecting to PA in %ums", self->reconnect_delay);
+    self->reconnect_id = g_timeout_add(self->reconnect_delay, reconnect_cb, self);
+    self->reconnect_delay = MIN(self->reconnect_delay * 2, RECONNECT_DELAY_MAX);
+}
+
+/*
+ * The PA connection was lost, most likely because the server restarted:
+ * drop everything tied to the old context and try again later.
+ */
+static void connection_lost(CadPulse *self)
+{
+    set_ready(self, FALSE);
+    self->restore_op = NULL;
+    self->discovery_pending = 0;
+    clear_events(self);
+
+    /* Their PA requests won't ever complete */
+    fail_operations(self);
+
+    clear_devices(self);
+    update_state(self);
+
+    pulse_disconnect(self);
+    schedule_reconnect(self);
+}
+
+static void pulse_state_cb(pa_context *ctx, void *data)
+{
+    CadPulse *self = data;
+    pa_context_state_t state;
+
+    state = pa_context_get_state(ctx);
+    switch (state) {
+    case PA_CONTEXT_UNCONNECTED:
+    case PA_CONTEXT_CONNECTING:
+    case PA_CONTEXT_AUTHORIZING:
+    case PA_CONTEXT_SETTING_NAME:
+        g_debug("PA not ready");
+        break;
+    case PA_CONTEXT_FAILED:
+    case PA_CONTEXT_TERMINATED:
+        g_warning("Lost connection to PulseAudio: %s", pa_strerror(pa_context_errno(ctx)));
+        connection_lost(self);
+        break;
+    case PA_CONTEXT_READY:
+        self->reconnect_delay = RECONNECT_DELAY_MIN;
+        pa_context_set_subscribe_callback(ctx, changed_cb, self);
+        pa_context_subscribe(ctx,
+                             PA_SUBSCRIPTION_MASK_SINK  | PA_SUBSCRIPTION_MASK_SOURCE |
+                             PA_SUBSCRIPTION_MASK_CARD  | PA_SUBSCRIPTION_MASK_SINK_INPUT |
+                             PA_SUBSCRIPTION_MASK_SOURCE_OUTPUT,
+                             subscribe_cb, self);
+        g_debug("PA is ready, initializing cards list");
+        init_cards_list(self);
+        break;
+    }
+}
+
+static void pulse_connect(CadPulse *self)
+{
+    pa_proplist *props;
+    int err;
+
+    /* Meta data */
+    props = pa_proplist_new();
+    g_assert(props != NULL);
+
+    pa_proplist_sets(props, PA_PROP_APPLICATION_NAME, APPLICATION_NAME);
+    pa_proplist_sets(props, PA_PROP_APPLICATION_ID, APPLICATION_ID);
+
+    self->ctx = pa_context_new_with_proplist(pa_glib_mainloop_get_api(self->loop),
+                                             APPLICATION_NAME, props);
+    pa_proplist_free(props);
+    if (!self->ctx)
+        g_error ("Error creating PulseAudio context");
+
+    pa_context_set_state_callback(self->ctx, (pa_context_notify_cb_t)pulse_state_cb, self);
+    err = pa_context_connect(self->ctx, NULL, PA_CONTEXT_NOFAIL, 0);
+    if (err < 0) {
+        g_warning("Error connecting to PulseAudio context: %s",
+                  pa_strerror(pa_context_errno(self->ctx)));
+        pulse_disconnect(self);
+        schedule_reconnect(self);
+    }
+}
+
+static void constructed(GObject *object)
+{
+    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
+    CadPulse *self = CAD_PULSE(object);
+
+    self->loop = pa_glib_mainloop_new(NULL);
+    if (!self->loop)
+        g_error ("Error creating PulseAudio main loop");
+
+    pulse_connect(self);
+
+    parent_class->constructed(object);
+}
+
+
+static void dispose(GObject *object)
+{
+    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
+    CadPulse *self = CAD_PULSE(object);
+
+    if (self->cards) {
+        clear_devices(self);
+        g_clear_pointer(&self->sinks, g_hash_table_unref);
+        g_clear_pointer(&self->sources, g_hash_table_unref);
+        g_clear_pointer(&self->cards, g_hash_table_unref);
+        g_clear_pointer(&self->sink_inputs, g_hash_table_unref);
+        g_clear_pointer(&self->source_outputs, g_hash_table_unref);
+    }
+    g_clear_pointer(&self->hold.sink_name, g_free);
+    g_clear_pointer(&self->hold.source_name, g_free);
+
+    g_clear_handle_id(&self->reconnect_id, g_source_remove);
+    g_clear_handle_id(&self->linger_id, g_source_remove);
+    pulse_disconnect(self);
+    g_clear_pointer(&self->rtt, g_hash_table_unref);
+    if (self->event_index) {
+        clear_events(self);
+        g_clear_pointer(&self->event_index, g_hash_table_unref);
+    }
+    g_clear_pointer(&self->loop, pa_glib_mainloop_free);
+
+    parent_class->dispose(object);
+}
+
+static void get_property(GObject *object, guint property_id,
+                         GValue *value, GParamSpec *pspec)
+{
+    CadPulse *self = CAD_PULSE(object);
+
+    switch (property_id) {
+    case PROP_AUDIO_MODE:
+        g_value_set_uint(value, self->audio_mode);
+        break;
+    case PROP_SPEAKER_STATE:
+        g_value_set_uint(value, self->speaker_state);
+        break;
+    case PROP_MIC_STATE:
+        g_value_set_uint(value, self->mic_state);
+        break;
+    case PROP_AVAILABLE:
+        g_value_set_boolean(value, self->available);
+        break;
+    case PROP_READY:
+        g_value_set_boolean(value, self->ready);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+static void cad_pulse_class_init(CadPulseClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->constructed = constructed;
+    object_class->dispose = dispose;
+    object_class->get_property = get_property;
+
+    props[PROP_AUDIO_MODE] =
+        g_param_spec_uint("audio-mode", "Audio mode", "Current audio mode",
+                          0, G_MAXUINT, CALL_AUDIO_MODE_UNKNOWN,
+                          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+    props[PROP_SPEAKER_STATE] =
+        g_param_spec_uint("speaker-state", "Speaker state", "Current speaker state",
+                          0, G_MAXUINT, CALL_AUDIO_SPEAKER_UNKNOWN,
+                          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+    props[PROP_MIC_STATE] =
+        g_param_spec_uint("mic-state", "Mic state", "Current microphone state",
+                          0, G_MAXUINT, CALL_AUDIO_MIC_UNKNOWN,
+                          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+    props[PROP_AVAILABLE] =
+        g_param_spec_boolean("available", "Available", "Whether a usable card was found",
+                             FALSE,
+                             G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+    props[PROP_READY] =
+        g_param_spec_boolean("ready", "Ready", "Whether requests can be executed",
+                             FALSE,
+                             G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_properties(object_class, PROP_LAST_PROP, props);
+}
+
+static void cad_pulse_init(CadPulse *self)
+{
+    self->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+    self->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+    self->mic_state = CALL_AUDIO_MIC_UNKNOWN;
+    self->reconnect_delay = RECONNECT_DELAY_MIN;
+    self->rtt = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    self->event_index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    self->cards = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                        NULL, (GDestroyNotify)card_free);
+    self->sinks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                        NULL, (GDestroyNotify)device_free);
+    self->sources = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, (GDestroyNotify)device_free);
+    self->sink_inputs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    self->source_outputs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    g_queue_init(&self->events);
+
+    self->requested.mode = CALL_AUDIO_MODE_UNKNOWN;
+    self->requested.speaker = CALL_AUDIO_SPEAKER_UNKNOWN;
+    self->requested.mic = CALL_AUDIO_MIC_UNKNOWN;
+}
+
+CadPulse *cad_pulse_get_default(void)
+{
+    static CadPulse *pulse = NULL;
+
+    if (pulse == NULL) {
+        g_debug("initializing pulseaudio backend...");
+        pulse = g_object_new(CAD_TYPE_PULSE, NULL);
+        g_object_add_weak_pointer(G_OBJECT(pulse), (gpointer *)&pulse);
+    }
+
+    return pulse;
+}
+
+static void step_free(CadPulseStep *step)
+{
+    g_clear_handle_id(&step->watchdog_id, g_source_remove);
+
+    if (step->pa_op) {
+        pa_operation_cancel(step->pa_op);
+        pa_operation_unref(step->pa_op);
+    }
+
+    g_ptr_array_unref(step->dependents);
+    g_free(step);
+}
+
+static CadPulseOperation *operation_new(CadOperation *cad_op)
+{
+    CadPulseOperation *operation = g_new0(CadPulseOperation, 1);
+
+    operation->pulse = cad_pulse_get_default();
+    operation->op = cad_op;
+    operation->mode = CALL_AUDIO_MODE_UNKNOWN;
+    operation->steps = g_ptr_array_new_with_free_func((GDestroyNotify)step_free);
+    operation->success = TRUE;
+
+    operation->pulse->operations = g_list_prepend(operation->pulse->operations, operation);
+
+    return operation;
+}
+
+/*
+ * Add a step to the operation graph. The step will be started once all the
+ * steps listed as dependencies (NULL-terminated) are done. If any of them
+ * failed, the step is skipped; with CAD_PULSE_STEP_ON_CHANGE, it is also
+ * skipped if any of them had nothing to do.
+ */
+static CadPulseStep *operation_add_step(CadPulseOperation *operation,
+                                        const gchar *name,
+                                        CadPulseStepFunc func,
+                                        guint value,
+                                        CadPulseStepMode mode,
+                                        ...)
+{
+    CadPulseStep *step = g_new0(CadPulseStep, 1);
+    CadPulseStep *dep;
+    va_list args;
+
+    step->name = name;
+    step->func = func;
+    step->operation = operation;
+    step->mode = mode;
+    step->value = value;
+    step->dependents = g_ptr_array_new();
+
+    va_start(args, mode);
+    while ((dep = va_arg(args, CadPulseStep *)) != NULL) {
+        g_ptr_array_add(dep->dependents, step);
+        step->n_deps++;
+    }
+    va_end(args);
+
+    g_ptr_array_add(operation->steps, step);
+    operation->n_pending++;
+
+    return step;
+}
+
+static void operation_finish(CadPulseOperation *operation)
+{
+    g_debug("operation returned %d", operation->success);
+
+    if (!operation->success)
+        resync_cache(operation->pulse);
+
+    if (operation->op) {
+        if (operation->mode != CALL_AUDIO_MODE_UNKNOWN && operation->success)
+            operation->pulse->current_mode = operation->mode;
+
+        /* Update the properties before the reply is sent */
+        update_state(operation->pulse);
+
+        operation->op->success = operation->success;
+        operation->op->callback(operation->op);
+    }
+
+    operation->pulse->operations = g_list_remove(operation->pulse->operations, operation);
+
+    g_ptr_array_unref(operation->steps);
+    free(operation);
+}
+
+static void step_done(CadPulseStep *step, gboolean changed, gboolean success)
+{
+    guint i;
+
+    g_debug("step '%s' done (changed=%d, success=%d)", step->name, changed, success);
+
+    step->started = TRUE;
+    step->operation->n_pending--;
+    if (!success)
+        step->operation->success = FALSE;
+
+    for (i = 0; i < step->dependents->len; i++) {
+        CadPulseStep *dependent = g_ptr_array_index(step->dependents, i);
+
+        if (dependent->started)
+            continue;
+
+        if (!success) {
+            g_debug("step '%s' skipped after failure", dependent->name);
+            step_done(dependent, FALSE, FALSE);
+        } else if (!changed && dependent->mode == CAD_PULSE_STEP_ON_CHANGE) {
+            g_debug("step '%s' skipped", dependent->name);
+            step_done(dependent, FALSE, TRUE);
+        } else {
+            dependent->n_deps--;
+        }
+    }
+}
+
+static void operation_abort(CadPulseOperation *operation, CadOperationError error);
+
+/*
+ * Same estimator as TCP's retransmission timeout (RFC 6298), the watchdog
+ * only fires once a reply is clearly overdue.
+ */
+static void update_rtt(CadPulse *self, const gchar *name, gint64 rtt)
+{
+    CadPulseRtt *entry = g_hash_table_lookup(self->rtt, name);
+
+    if (!entry) {
+        entry = g_new0(CadPulseRtt, 1);
+        entry->srtt = rtt;
+        entry->rttvar = rtt / 2;
+        g_hash_table_insert(self->rtt, g_strdup(name), entry);
+        return;
+    }
+
+    entry->rttvar = (3 * entry->rttvar + ABS(entry->srtt - rtt)) / 4;
+    entry->srtt = (7 * entry->srtt + rtt) / 8;
+}
+
+static guint step_timeout(CadPulse *self, const gchar *name)
+{
+    CadPulseRtt *entry = g_hash_table_lookup(self->rtt, name);
+    gint64 timeout;
+
+    if (!entry)
+        return WATCHDOG_DEFAULT_TIMEOUT;
+
+    timeout = (entry->srtt + 4 * entry->rttvar) / 1000;
+
+    return CLAMP(timeout, WATCHDOG_MIN_TIMEOUT, WATCHDOG_MAX_TIMEOUT);
+}
+
+static gboolean step_watchdog_cb(gpointer data)
+{
+    CadPulseStep *step = data;
+
+    g_warning("step '%s' timed out after %" G_GINT64_FORMAT "ms, failing operation",
+              step->name, (g_get_monotonic_time() - step->start_time) / 1000);
+
+    step->watchdog_id = 0;
+    operation_abort(step->operation, CAD_OPERATION_ERROR_FAILED);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void operation_run(CadPulseOperation *operation)
+{
+    gboolean progress = TRUE;
+    gboolean in_flight = FALSE;
+    guint i;
+
+    /* Steps completing synchronously must not re-enter the loop below */
+    if (operation->running)
+        return;
+
+    operation->running = TRUE;
+    while (progress) {
+        progress = FALSE;
+
+        for (i = 0; i < operation->steps->len; i++) {
+            CadPulseStep *step = g_ptr_array_index(operation->steps, i);
+            pa_operation *op;
+
+            if (step->started || step->n_deps > 0)
+                continue;
+
+            step->started = TRUE;
+            op = step->func(operation, step);
+            if (op || step->waiting) {
+                step->pa_op = op;
+                step->start_time = g_get_monotonic_time();
+                step->watchdog_id = g_timeout_add(step_timeout(operation->pulse, step->name),
+                                                  step_watchdog_cb, step);
+                if (operation->op && operation->op->started == 0)
+                    operation->op->started = step->start_time;
+            } else if (step->failed) {
+                g_warning("%s: unable to issue request", step->name);
+                step_done(step, FALSE, FALSE);
+                progress = TRUE;
+            } else {
+                g_debug("%s: nothing to be done", step->name);
+                step_done(step, FALSE, TRUE);
+                progress = TRUE;
+            }
+        }
+    }
+    operation->running = FALSE;
+
+    if (operation->n_pending == 0) {
+        operation_finish(operation);
+        return;
+    }
+
+    for (i = 0; i < operation->steps->len; i++) {
+        CadPulseStep *step = g_ptr_array_index(operation->steps, i);
+
+        if (step->pa_op || step->waiting) {
+            in_flight = TRUE;
+            break;
+        }
+    }
+
+    /* Should never happen, but the client would hang forever */
+    if (!in_flight) {
+        g_critical("operation stalled with %u pending steps", operation->n_pending);
+        operation_abort(operation, CAD_OPERATION_ERROR_FAILED);
+        return;
+    }
+
+    update_state(operation->pulse);
+}
+
+static void step_complete_cb(pa_context *ctx, int success, void *data)
+{
+    CadPulseStep *step = data;
+    CadPulseOperation *operation = step->operation;
+
+    gint64 rtt = g_get_monotonic_time() - step->start_time;
+
+    g_clear_pointer(&step->pa_op, pa_operation_unref);
+    g_clear_handle_id(&step->watchdog_id, g_source_remove);
+
+    update_rtt(operation->pulse, step->name, rtt);
+    cad_stats_record_step(step->name, rtt);
+    step_done(step, TRUE, !!success);
+    operation_run(operation);
+}
+
+/*
+ * The devices of @card replaced by a profile switch are there: resume the
+ * operations waiting for them, their remaining steps now using these.
+ */
+static void resume_waiting_steps(CadPulse *self, guint32 card)
+{
+    GList *l = self->operations;
+
+    while (l) {
+        CadPulseOperation *operation = l->data;
+        GList *next = l->next;
+        gboolean resumed = FALSE;
+        guint i;
+
+        for (i = 0; i < operation->steps->len; i++) {
+            CadPulseStep *step = g_ptr_array_index(operation->steps, i);
+            gint64 rtt;
+
+            if (!step->waiting || step->value != card)
+                continue;
+
+            rtt = g_get_monotonic_time() - step->start_time;
+            step->waiting = FALSE;
+            g_clear_handle_id(&step->watchdog_id, g_source_remove);
+
+            update_rtt(self, step->name, rtt);
+            cad_stats_record_step(step->name, rtt);
+            step_done(step, TRUE, TRUE);
+            resumed = TRUE;
+        }
+
+        /* This may complete the operation, removing it from the list */
+        if (resumed)
+            operation_run(operation);
+
+        l = next;
+    }
+}
+
+/*
+ * Whether switching profile replaces the card's devices: Bluetooth and UCM
+ * cards do, whereas the droid HAL keeps its own and only reroutes them.
+ */
+static gboolean profile_replaces_devices(CadPulse *self)
+{
+#ifdef WITH_DROID_SUPPORT
+    if (self->sink && self->sink->is_droid)
+        return FALSE;
+#endif /* WITH_DROID_SUPPORT */
+
+    return self->card->is_bluez || self->card->has_voice_profile;
+}
+
+static pa_operation *set_card_profile(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseCard *card = operation->pulse->card;
+    pa_operation *op = NULL;
+    const gchar *default_profile;
+    const gchar *voicecall_profile;
+    const gchar *target_profile = NULL;
+
+    if (!card) {
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    default_profile = card->media_profile;
+    voicecall_profile = card->call_profile;
+
+    if (card_in_call_profile(card) && step->value == 0) {
+        g_debug("switching to default profile");
+        target_profile = default_profile;
+    } else if (step->value == 1 && !card_in_call_profile(card) &&
+               /* Bluetooth devices may be in any profile, e.g. "off" */
+               (card->is_bluez || g_strcmp0(card->active_profile, default_profile) == 0)) {
+        g_debug("switching to voice profile");
+        target_profile = voicecall_profile;
+    }
+
+    if (target_profile) {
+        op = pa_context_set_card_profile_by_index(operation->pulse->ctx, card->index,
+                                                  target_profile,
+                                                  step_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op) {
+        replace_string(&card->active_profile, target_profile);
+        if (profile_replaces_devices(operation->pulse))
+            card->switch_start = g_get_monotonic_time();
+    }
+
+    return op;
+}
+
+/*
+ * Writes to devices replaced by a profile switch would hit the old ones:
+ * hold them until the new ones are picked up, which resumes the step.
+ */
+static pa_operation *wait_devices(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseCard *card = g_hash_table_lookup(operation->pulse->cards,
+                                             GUINT_TO_POINTER(step->value));
+
+    if (!card) {
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    if (card->switch_start) {
+        g_debug("waiting for the new devices of card %u", card->index);
+        step->waiting = TRUE;
+    }
+
+    return NULL;
+}
+
+#ifdef WITH_DROID_SUPPORT
+/*
+ * Android HAL switches modes once the next routing change happens.
+ * Thus, we need to "park" the sink/source before switching to the
+ * actual port.
+ *
+ * pulseaudio-modules-droid provides the input-parking and output-parking
+ * ports to accomplish that.
+ *
+ * It's one more step that needs to be done only on droid devices.
+ */
+static pa_operation *droid_park_output(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseDevice *sink = operation->pulse->sink;
+    pa_operation *op;
+    gint parking;
+
+    if (!sink) {
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    parking = find_port_class(sink, CAD_POLICY_PORT_PARKING);
+    if (parking < 0) {
+        g_warning("droid: no parking output port");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    g_debug("droid: parking output to trigger mode change");
+
+    op = pa_context_set_sink_port_by_index(operation->pulse->ctx, sink->index,
+                                           port_name(sink, parking),
+                                           step_complete_cb, step);
+    step->failed = !op;
+    if (op)
+        sink->active_port = parking;
+
+    return op;
+}
+
+static pa_operation *droid_park_input(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseDevice *source = operation->pulse->source;
+    pa_operation *op;
+    gint parking;
+
+    if (!source) {
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    parking = find_port_class(source, CAD_POLICY_PORT_PARKING);
+    if (parking < 0) {
+        g_warning("droid: no parking input port");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    g_debug("droid: parking input to trigger mode change");
+
+    op = pa_context_set_source_port_by_index(operation->pulse->ctx, source->index,
+                                             port_name(source, parking),
+                                             step_complete_cb, step);
+    step->failed = !op;
+    if (op)
+        source->active_port = parking;
+
+    return op;
+}
+#endif /* WITH_DROID_SUPPORT */
+
+static pa_operation *set_output_port(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseDevice *sink = operation->pulse->sink;
+    pa_operation *op = NULL;
+    gint target_port;
+
+    if (!sink) {
+        g_warning("card has no usable sink");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    /*
+     * When forcing speaker output, we simply select the speaker port.
+     *
+     * When switching to voice call mode or disabling speaker output, we want
+     * the highest priority port other than the speaker; this makes sure we
+     * use the headphones if they are connected, and the earpiece otherwise.
+     *
+     * When switching back to normal mode, the highest priority port is to
+     * be selected anyway.
+     */
+    switch (step->value) {
+    case CAD_PULSE_OUTPUT_SPEAKER:
+        target_port = sink->speaker_port;
+        break;
+    case CAD_PULSE_OUTPUT_NO_SPEAKER:
+        if (operation->plan.valid && operation->plan.sink == sink->index)
+            target_port = operation->plan.output_port;
+        else
+            target_port = get_available_output(sink, CAD_POLICY_PORT_SPEAKER |
+                                                     CAD_POLICY_PORT_PARKING);
+        break;
+    case CAD_PULSE_OUTPUT_BEST:
+        target_port = get_available_output(sink, CAD_POLICY_PORT_PARKING);
+        break;
+    default:
+        return NULL;
+    }
+
+    if (target_port < 0) {
+        g_warning("no suitable output port found");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    g_debug("active port is '%s', target port is '%s'",
+            port_name(sink, sink->active_port), port_name(sink, target_port));
+
+    if (sink->active_port != target_port) {
+        g_debug("switching to target port '%s'", port_name(sink, target_port));
+        op = pa_context_set_sink_port_by_index(operation->pulse->ctx, sink->index,
+                                               port_name(sink, target_port),
+                                               step_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op)
+        sink->active_port = target_port;
+
+    return op;
+}
+
+static pa_operation *set_input_port(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseDevice *sink = operation->pulse->sink;
+    CadPulseDevice *source = operation->pulse->source;
+    pa_operation *op = NULL;
+    gint target_port;
+
+    if (!source) {
+        g_warning("card has no usable source");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    /*
+     * The output step has already picked its port (or at least issued the
+     * request), so the input follows it.
+     */
+    if (operation->plan.valid && operation->plan.source == source->index &&
+        operation->plan.input_port >= 0)
+        target_port = operation->plan.input_port;
+    else
+        target_port = get_best_input(source, paired_input_class(sink, sink ? sink->active_port : -1));
+    if (target_port < 0) {
+        g_warning("no suitable input port found");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    g_debug("active source port is '%s', target source port is '%s'",
+            port_name(source, source->active_port), port_name(source, target_port));
+
+    if (source->active_port != target_port) {
+        g_debug("switching to target source port '%s'", port_name(source, target_port));
+        op = pa_context_set_source_port_by_index(operation->pulse->ctx, source->index,
+                                                 port_name(source, target_port),
+                                                 step_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op)
+        source->active_port = target_port;
+
+    return op;
+}
+
+static pa_operation *set_mic_mute(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseDevice *source = operation->pulse->source;
+    pa_operation *op = NULL;
+
+    if (!source) {
+        g_warning("card has no usable source");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    if (source->mute && !step->value) {
+        g_debug("mic is muted, unmuting...");
+        op = pa_context_set_source_mute_by_index(operation->pulse->ctx, source->index, 0,
+                                                 step_complete_cb, step);
+        step->failed = !op;
+    } else if (!source->mute && step->value) {
+        g_debug("mic is active, muting...");
+        op = pa_context_set_source_mute_by_index(operation->pulse->ctx, source->index, 1,
+                                                 step_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op)
+        source->mute = !!step->value;
+
+    return op;
+}
+
+static pa_operation *set_output_mute(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulseDevice *sink = operation->pulse->sink;
+    pa_operation *op = NULL;
+
+    if (!sink) {
+        g_warning("card has no usable sink");
+        step->failed = TRUE;
+        return NULL;
+    }
+
+    if (sink->mute != !!step->value) {
+        g_debug("%s output", step->value ? "muting" : "unmuting");
+        op = pa_context_set_sink_mute_by_index(operation->pulse->ctx, sink->index,
+                                               step->value ? 1 : 0,
+                                               step_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op)
+        sink->mute = !!step->value;
+
+    return op;
+}
+
+/*
+ * Streams, and devices not used for calls, can go away at any time: failing
+ * to write to one isn't an error
+ */
+static void optional_complete_cb(pa_context *ctx, int success, void *data)
+{
+    CadPulseStep *step = data;
+
+    if (!success)
+        g_debug("%s: %s", step->name, pa_strerror(pa_context_errno(ctx)));
+
+    step_complete_cb(ctx, TRUE, data);
+}
+
+static pa_operation *release_output(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulse *self = operation->pulse;
+    CadPulseDevice *sink = g_hash_table_lookup(self->sinks, GUINT_TO_POINTER(step->value));
+    pa_operation *op = NULL;
+
+    if (sink && sink->mute != self->hold.sink_mute) {
+        g_debug("restoring mute state of previously held sink %u", sink->index);
+        op = pa_context_set_sink_mute_by_index(self->ctx, sink->index, self->hold.sink_mute,
+                                               optional_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op)
+        sink->mute = self->hold.sink_mute;
+
+    return op;
+}
+
+static pa_operation *release_input(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulse *self = operation->pulse;
+    CadPulseDevice *source = g_hash_table_lookup(self->sources, GUINT_TO_POINTER(step->value));
+    pa_operation *op = NULL;
+
+    if (source && source->mute != self->hold.source_mute) {
+        g_debug("restoring mute state of previously held source %u", source->index);
+        op = pa_context_set_source_mute_by_index(self->ctx, source->index, self->hold.source_mute,
+                                                 optional_complete_cb, step);
+        step->failed = !op;
+    }
+
+    if (op)
+        source->mute = self->hold.source_mute;
+
+    return op;
+}
+
+static pa_operation *move_sink_input(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulse *self = operation->pulse;
+    CadPulseStream *stream = g_hash_table_lookup(self->sink_inputs,
+                                                 GUINT_TO_POINTER(step->value));
+    pa_operation *op;
+
+    if (!stream || !self->sink || stream->device == self->sink->index)
+        return NULL;
+
+    g_debug("moving sink input %u to sink %u", stream->index, self->sink->index);
+    op = pa_context_move_sink_input_by_index(self->ctx, stream->index, self->sink->index,
+                                             optional_complete_cb, step);
+    step->failed = !op;
+    if (op)
+        stream->device = self->sink->index;
+
+    return op;
+}
+
+static pa_operation *move_source_output(CadPulseOperation *operation, CadPulseStep *step)
+{
+    CadPulse *self = operation->pulse;
+    CadPulseStream *stream = g_hash_table_lookup(self->source_outputs,
+                                                 GUINT_TO_POINTER(step->value));
+    pa_operation *op;
+
+    if (!stream || !self->source || stream->device == self->source->index)
+        return NULL;
+
+    g_debug("moving source output %u to source %u", stream->index, self->source->index);
+    op = pa_context_move_source_output_by_index(self->ctx, stream->index, self->source->index,
+                                                optional_complete_cb, step);
+    step->failed = !op;
+    if (op)
+        stream->device = self->source->index;
+
+    return op;
+}
+
+/*
+ * In call mode, move the phone streams to the devices used for the call, so
+ * apps don't have to do it themselves (racing with us). The moves are issued
+ * along with the port selection, after @dep if not NULL.
+ *
+ * Cards whose call profile brings other devices get their streams moved
+ * once those are picked up, as the requested route is applied to them again.
+ */
+static void add_stream_steps(CadPulseOperation *operation, guint mode, CadPulseStep *dep)
+{
+    CadPulse *self = operation->pulse;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (mode != CALL_AUDIO_MODE_CALL)
+        return;
+
+    g_hash_table_iter_init(&iter, self->sink_inputs);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseStream *stream = value;
+
+        operation_add_step(operation, "move-sink-input", move_sink_input,
+                           stream->index, CAD_PULSE_STEP_AFTER, dep, NULL);
+    }
+
+    g_hash_table_iter_init(&iter, self->source_outputs);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseStream *stream = value;
+
+        operation_add_step(operation, "move-source-output", move_source_output,
+                           stream->index, CAD_PULSE_STEP_AFTER, dep, NULL);
+    }
+}
+
+/*
+ * Putting a call on hold mutes both directions on the current route, and
+ * resuming it restores the previous mute states: no profile or port change
+ * is involved, both writes being issued at once.
+ */
+static void add_hold_steps(CadPulseOperation *operation, gboolean hold)
+{
+    CadPulse *self = operation->pulse;
+
+    if (hold == self->hold.active)
+        return;
+
+    self->hold.active = hold;
+    if (hold) {
+        self->hold.sink_mute = self->sink ? self->sink->mute : FALSE;
+        self->hold.source_mute = self->source ? self->source->mute : FALSE;
+    }
+
+    g_debug("%s call", hold ? "holding" : "resuming");
+
+    if (self->sink)
+        operation_add_step(operation, hold ? "hold-output" : "resume-output",
+                           set_output_mute, hold || self->hold.sink_mute,
+                           CAD_PULSE_STEP_AFTER, NULL);
+    if (self->source)
+        operation_add_step(operation, hold ? "hold-input" : "resume-input",
+                           set_mic_mute, hold || self->hold.source_mute,
+                           CAD_PULSE_STEP_AFTER, NULL);
+}
+
+static CadPulseDevice *find_named_device(GHashTable *devices, const gchar *name)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!name)
+        return NULL;
+
+    g_hash_table_iter_init(&iter, devices);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPulseDevice *dev = value;
+
+        if (g_strcmp0(dev->name, name) == 0)
+            return dev;
+    }
+
+    return NULL;
+}
+
+/*
+ * Unmute the devices left muted by a dropped hold, unless they were muted
+ * before: these can be the current ones after PA restarted, in which case
+ * the mic state is left to @route if it sets one.
+ */
+static void add_release_steps(CadPulseOperation *operation, const CadRoute *route)
+{
+    CadPulse *self = operation->pulse;
+    CadPulseDevice *dev;
+
+    dev = find_named_device(self->sinks, self->hold.sink_name);
+    if (dev)
+        operation_add_step(operation, "release-output", release_output,
+                           dev->index, CAD_PULSE_STEP_AFTER, NULL);
+
+    dev = find_named_device(self->sources, self->hold.source_name);
+    if (dev && (dev != self->source || (route->mic == CALL_AUDIO_MIC_UNKNOWN &&
+                                        route->mode != CALL_AUDIO_MODE_DEFAULT)))
+        operation_add_step(operation, "release-input", release_input,
+                           dev->index, CAD_PULSE_STEP_AFTER, NULL);
+
+    g_clear_pointer(&self->hold.sink_name, g_free);
+    g_clear_pointer(&self->hold.source_name, g_free);
+}
+
+/*
+ * Add the output and input port selection steps to the operation graph: the
+ * input port is paired with the chosen output, so both are switched as part
+ * of the same route change.
+ *
+ * The droid HAL needs the input to be routed after the output, but on native
+ * devices both ports are independent: the input step is added right after
+ * the output one, so both requests are issued together.
+ */
+static void add_port_steps(CadPulseOperation *operation, CadPulseOutput output,
+                           CadPulseStepMode mode,
+                           CadPulseStep *dep1, CadPulseStep *dep2)
+{
+    CadPulseStep *output_step;
+
+    output_step = operation_add_step(operation, "set-output-port", set_output_port,
+                                     output, mode, dep1, dep2, NULL);
+
+#ifdef WITH_DROID_SUPPORT
+    if (operation->pulse->sink && operation->pulse->sink->is_droid) {
+        operation_add_step(operation, "set-input-port", set_input_port,
+                           0, CAD_PULSE_STEP_ON_CHANGE, output_step, NULL);
+        return;
+    }
+#else
+    (void)output_step;
+#endif /* WITH_DROID_SUPPORT */
+
+    if (operation->pulse->source)
+        operation_add_step(operation, "set-input-port", set_input_port,
+                           0, mode, dep1, dep2, NULL);
+}
+
+/*
+ * Once the profile switch is acknowledged, wait for the devices it brings if
+ * anything is to be written to them. Returns the step to depend on.
+ */
+static CadPulseStep *add_wait_step(CadPulseOperation *operation, CadPulseStep *profile,
+                                   guint mode, guint mic, gboolean forced_output)
+{
+    CadPulse *self = operation->pulse;
+    gboolean streams = (g_hash_table_size(self->sink_inputs) > 0 ||
+                        g_hash_table_size(self->source_outputs) > 0);
+
+    if (!forced_output && mic == CALL_AUDIO_MIC_UNKNOWN &&
+        (mode != CALL_AUDIO_MODE_CALL || !streams))
+        return profile;
+
+    return operation_add_step(operation, "wait-devices", wait_devices,
+                              self->card->index, CAD_PULSE_STEP_ON_CHANGE, profile, NULL);
+}
+
+/*
+ * Record the state requested by clients, so it can be restored after a PA
+ * restart. Selecting a mode resets the speaker to the mode's default.
+ */
+static void remember_route(CadPulse *self, guint mode, guint speaker, guint mic)
+{
+    if (mode == CALL_AUDIO_MODE_HOLD) {
+        /* Holding keeps the route, a held call is restored active */
+    } else if (mode == CALL_AUDIO_MODE_CALL && self->hold.active &&
+               speaker == CALL_AUDIO_SPEAKER_UNKNOWN) {
+        /* Resuming keeps the route too */
+        self->requested.mode = mode;
+    } else if (mode != CALL_AUDIO_MODE_UNKNOWN) {
+        self->requested.mode = mode;
+        self->requested.speaker = speaker;
+        if (mode == CALL_AUDIO_MODE_DEFAULT)
+            self->requested.mic = CALL_AUDIO_MIC_UNKNOWN;
+    } else if (speaker != CALL_AUDIO_SPEAKER_UNKNOWN) {
+        self->requested.speaker = speaker;
+    }
+
+    if (mic != CALL_AUDIO_MIC_UNKNOWN)
+        self->requested.mic = mic;
+
+    /* Bluetooth devices are left aside while the speaker is requested */
+    select_devices(self);
+}
+
+/*
+ * Build the graph of steps needed to reach the requested route: @mode can
+ * be CALL_AUDIO_MODE_UNKNOWN and @mic CALL_AUDIO_MIC_UNKNOWN to leave them
+ * untouched, and @output CAD_PULSE_OUTPUT_UNCHANGED to keep the default
+ * port selection for the requested mode (if any).
+ */
+static void add_route_steps(CadPulseOperation *operation, guint mode,
+                            CadPulseOutput output, guint mic)
+{
+    CadPulse *self = operation->pulse;
+    gboolean forced_output = (output != CAD_PULSE_OUTPUT_UNCHANGED);
+
+    if (mode == CALL_AUDIO_MODE_HOLD) {
+        add_hold_steps(operation, TRUE);
+        if (mic != CALL_AUDIO_MIC_UNKNOWN)
+            self->hold.source_mute = (mic == CALL_AUDIO_MIC_OFF);
+        if (forced_output)
+            add_port_steps(operation, output, CAD_PULSE_STEP_AFTER, NULL, NULL);
+        return;
+    }
+
+    if (self->hold.active) {
+        /* The mic state is only applied when resuming */
+        if (mic != CALL_AUDIO_MIC_UNKNOWN) {
+            self->hold.source_mute = (mic == CALL_AUDIO_MIC_OFF);
+            mic = CALL_AUDIO_MIC_UNKNOWN;
+        }
+
+        if (mode != CALL_AUDIO_MODE_UNKNOWN) {
+            add_hold_steps(operation, FALSE);
+
+            /* The route was left untouched while on hold */
+            if (mode == CALL_AUDIO_MODE_CALL && !forced_output) {
+                stop_linger(self, mode);
+                return;
+            }
+        }
+    }
+
+    /* Devices replaced by switching to the call profile are only muted once there */
+    if (mic != CALL_AUDIO_MIC_UNKNOWN &&
+        (mode != CALL_AUDIO_MODE_CALL || !profile_replaces_devices(self))) {
+        operation_add_step(operation, "set-mic-mute", set_mic_mute,
+                           mic == CALL_AUDIO_MIC_OFF, CAD_PULSE_STEP_AFTER, NULL);
+        mic = CALL_AUDIO_MIC_UNKNOWN;
+    } else if (mode == CALL_AUDIO_MODE_DEFAULT && self->source) {
+        /*
+         * When ending a call, we want to make sure the mic doesn't stay muted
+         */
+        operation_add_step(operation, "unmute-mic", set_mic_mute,
+                           FALSE, CAD_PULSE_STEP_AFTER, NULL);
+    }
+
+    if (mode == CALL_AUDIO_MODE_UNKNOWN) {
+        if (forced_output)
+            add_port_steps(operation, output, CAD_PULSE_STEP_AFTER, NULL, NULL);
+        return;
+    }
+
+    stop_linger(self, mode);
+
+    /* A prepared plan is only good for the call it was prepared for */
+    if (mode == CALL_AUDIO_MODE_CALL && !forced_output)
+        operation->plan = self->plan;
+    discard_plan(self);
+
+    operation->mode = mode;
+    if (!forced_output)
+        output = (mode == CALL_AUDIO_MODE_CALL) ? CAD_PULSE_OUTPUT_NO_SPEAKER :
+                                                  CAD_PULSE_OUTPUT_BEST;
+
+    if (self->card->is_bluez) {
+        CadPulseStep *profile, *devices;
+
+        /* Each profile has its own devices, with a single port */
+        g_debug("bluetooth card, switching profile");
+        profile = operation_add_step(operation, "set-bt-profile", set_card_profile,
+                                     mode, CAD_PULSE_STEP_AFTER, NULL);
+        devices = add_wait_step(operation, profile, mode, mic, forced_output);
+        add_stream_steps(operation, mode, devices);
+        if (mic != CALL_AUDIO_MIC_UNKNOWN)
+            operation_add_step(operation, "set-mic-mute", set_mic_mute,
+                               mic == CALL_AUDIO_MIC_OFF, CAD_PULSE_STEP_AFTER, devices, NULL);
+    } else if (self->card->has_voice_profile) {
+        CadPulseStep *profile, *devices;
+
+        g_debug("card has voice profile, using it");
+        profile = operation_add_step(operation, "set-card-profile", set_card_profile,
+                                     mode, CAD_PULSE_STEP_AFTER, NULL);
+
+#ifdef WITH_DROID_SUPPORT
+        if (self->sink && self->sink->is_droid) {
+            CadPulseStep *park_output, *park_input;
+
+            park_output = operation_add_step(operation, "droid-park-output",
+                                             droid_park_output, 0,
+                                             CAD_PULSE_STEP_ON_CHANGE, profile, NULL);
+            /* The HAL needs the input to be routed after the output */
+            park_input = operation_add_step(operation, "droid-park-input",
+                                            droid_park_input, 0,
+                                            CAD_PULSE_STEP_ON_CHANGE, park_output, NULL);
+            add_port_steps(operation, output,
+                           forced_output ? CAD_PULSE_STEP_AFTER : CAD_PULSE_STEP_ON_CHANGE,
+                           park_output, park_input);
+            add_stream_steps(operation, mode, profile);
+            return;
+        }
+#endif /* WITH_DROID_SUPPORT */
+
+        devices = add_wait_step(operation, profile, mode, mic, forced_output);
+        add_stream_steps(operation, mode, devices);
+        if (mic != CALL_AUDIO_MIC_UNKNOWN)
+            operation_add_step(operation, "set-mic-mute", set_mic_mute,
+                               mic == CALL_AUDIO_MIC_OFF, CAD_PULSE_STEP_AFTER, devices, NULL);
+
+        /* The profile switch selects the ports unless told otherwise */
+        if (forced_output)
+            add_port_steps(operation, output, CAD_PULSE_STEP_AFTER, devices, NULL);
+    } else {
+        g_debug("card doesn't have voice profile, switching output port");
+        add_port_steps(operation, output, CAD_PULSE_STEP_AFTER, NULL, NULL);
+        add_stream_steps(operation, mode, NULL);
+    }
+}
+
+void cad_pulse_select_mode(guint mode, CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_SELECT_MODE);
+
+    operation = operation_new(cad_op);
+    remember_route(operation->pulse, mode, CALL_AUDIO_SPEAKER_UNKNOWN, CALL_AUDIO_MIC_UNKNOWN);
+
+    if (!operation->pulse->card) {
+        g_warning("no usable card found");
+        goto error;
+    }
+
+    if (mode == CALL_AUDIO_MODE_HOLD && !in_call(operation->pulse)) {
+        g_warning("no call to put on hold");
+        goto error;
+    }
+
+    /*
+     * Leaving the call profile may be deferred, but the call is over all the
+     * same: don't leave it on hold meanwhile
+     */
+    if (mode != CALL_AUDIO_MODE_DEFAULT || !start_linger(operation->pulse))
+        add_route_steps(operation, mode, CAD_PULSE_OUTPUT_UNCHANGED, CALL_AUDIO_MIC_UNKNOWN);
+    else
+        add_hold_steps(operation, FALSE);
+
+    operation_run(operation);
+    return;
+
+error:
+    operation->success = FALSE;
+    operation_finish(operation);
+}
+
+void cad_pulse_enable_speaker(gboolean enable, CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_ENABLE_SPEAKER);
+
+    operation = operation_new(cad_op);
+    remember_route(operation->pulse, CALL_AUDIO_MODE_UNKNOWN,
+                   enable ? CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF,
+                   CALL_AUDIO_MIC_UNKNOWN);
+
+    if (!operation->pulse->sink) {
+        g_warning("card has no usable sink");
+        goto error;
+    }
+
+    add_route_steps(operation, CALL_AUDIO_MODE_UNKNOWN,
+                    enable ? CAD_PULSE_OUTPUT_SPEAKER : CAD_PULSE_OUTPUT_NO_SPEAKER,
+                    CALL_AUDIO_MIC_UNKNOWN);
+
+    operation_run(operation);
+    return;
+
+error:
+    operation->success = FALSE;
+    operation_finish(operation);
+}
+
+void cad_pulse_mute_mic(gboolean mute, CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_MUTE_MIC);
+
+    operation = operation_new(cad_op);
+    remember_route(operation->pulse, CALL_AUDIO_MODE_UNKNOWN, CALL_AUDIO_SPEAKER_UNKNOWN,
+                   mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON);
+
+    if (!operation->pulse->source) {
+        g_warning("card has no usable source");
+        goto error;
+    }
+
+    add_route_steps(operation, CALL_AUDIO_MODE_UNKNOWN, CAD_PULSE_OUTPUT_UNCHANGED,
+                    mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON);
+
+    operation_run(operation);
+    return;
+
+error:
+    operation->success = FALSE;
+    operation_finish(operation);
+}
+
+/*
+ * Check the devices needed by @route are there, and apply it
+ */
+static void run_route(CadPulseOperation *operation, const CadRoute *route)
+{
+    CadPulseOutput output = CAD_PULSE_OUTPUT_UNCHANGED;
+    gboolean devices_pending;
+
+    if (route->mode != CALL_AUDIO_MODE_UNKNOWN && !operation->pulse->card) {
+        g_warning("no usable card found");
+        goto error;
+    }
+
+    /*
+     * The call profile may bring the devices (e.g. Bluetooth ones only get a
+     * source in HFP): the steps using them check they're there once it does
+     */
+    devices_pending = (route->mode == CALL_AUDIO_MODE_CALL &&
+                       profile_replaces_devices(operation->pulse));
+
+    if (route->speaker != CALL_AUDIO_SPEAKER_UNKNOWN && !operation->pulse->sink &&
+        !devices_pending) {
+        g_warning("card has no usable sink");
+        goto error;
+    }
+    if (route->mic != CALL_AUDIO_MIC_UNKNOWN && !operation->pulse->source &&
+        !devices_pending) {
+        g_warning("card has no usable source");
+        goto error;
+    }
+    if (route->mode == CALL_AUDIO_MODE_HOLD && !in_call(operation->pulse)) {
+        g_warning("no call to put on hold");
+        goto error;
+    }
+
+    if (route->speaker == CALL_AUDIO_SPEAKER_ON)
+        output = CAD_PULSE_OUTPUT_SPEAKER;
+    else if (route->speaker == CALL_AUDIO_SPEAKER_OFF)
+        output = CAD_PULSE_OUTPUT_NO_SPEAKER;
+
+    add_route_steps(operation, route->mode, output, route->mic);
+
+    operation_run(operation);
+    return;
 
 error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        cad_op->callback(cad_op);
+    operation->success = FALSE;
+    operation_finish(operation);
+}
+
+/*
+ * Apply a mode, speaker and mic state at once: all the required PA writes are
+ * computed from the cache and executed as a single operation graph, so the
+ * request costs a single D-Bus round-trip.
+ */
+void cad_pulse_apply_route(const CadRoute *route, CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_APPLY_ROUTE);
+
+    operation = operation_new(cad_op);
+    remember_route(operation->pulse, route->mode, route->speaker, route->mic);
+
+    run_route(operation, route);
+}
+
+/*
+ * Apply the last route requested by clients again, after reconnecting to PA
+ * or when other devices are selected for calls.
+ */
+void cad_pulse_restore(CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    g_assert(cad_op->type == CAD_OPERATION_RESTORE);
+
+    operation = operation_new(cad_op);
+    cad_op->route = operation->pulse->requested;
+
+    add_release_steps(operation, &cad_op->route);
+    run_route(operation, &cad_op->route);
+}
+
+/*
+ * Select the ports again from the cached state, after their availability
+ * changed during a call.
+ */
+void cad_pulse_reroute(CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+    CadPulse *self;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    g_assert(cad_op->type == CAD_OPERATION_REROUTE);
+
+    operation = operation_new(cad_op);
+    self = operation->pulse;
+
+    /* The call may have ended in the meantime */
+    if (in_call(self)) {
+        add_port_steps(operation,
+                       self->requested.speaker == CALL_AUDIO_SPEAKER_ON ?
+                           CAD_PULSE_OUTPUT_SPEAKER : CAD_PULSE_OUTPUT_NO_SPEAKER,
+                       CAD_PULSE_STEP_AFTER, NULL, NULL);
+        add_stream_steps(operation, CALL_AUDIO_MODE_CALL, NULL);
+    }
+
+    operation_run(operation);
+}
+
+/*
+ * Abort an in-flight operation: pending PA requests are cancelled so none of
+ * their callbacks will fire, the steps which haven't been started are
+ * dropped, and the operation completes with the given error. Writes which
+ * were already sent are applied by the server anyway and are reflected in
+ * the cache, so the next operation starts from the state actually reached.
+ */
+static void operation_abort(CadPulseOperation *operation, CadOperationError error)
+{
+    guint i;
+
+    for (i = 0; i < operation->steps->len; i++) {
+        CadPulseStep *step = g_ptr_array_index(operation->steps, i);
+
+        if (step->pa_op) {
+            g_debug("step '%s' cancelled", step->name);
+            pa_operation_cancel(step->pa_op);
+            g_clear_pointer(&step->pa_op, pa_operation_unref);
+        }
+    }
+
+    if (operation->op)
+        operation->op->error = error;
+    operation->success = FALSE;
+    operation_finish(operation);
+}
+
+void cad_pulse_cancel(CadOperation *cad_op, CadOperationError error)
+{
+    CadPulse *self = cad_pulse_get_default();
+    GList *l;
+
+    for (l = self->operations; l; l = l->next) {
+        CadPulseOperation *operation = l->data;
+
+        if (operation->op == cad_op) {
+            g_debug("cancelling operation %d", cad_op->type);
+            operation_abort(operation, error);
+            return;
+        }
+    }
+}
+
+static void fail_operations(CadPulse *self)
+{
+    while (self->operations) {
+        CadPulseOperation *operation = self->operations->data;
+
+        g_debug("failing in-flight operation");
+        /* This removes the operation from the list */
+        operation_abort(operation, CAD_OPERATION_ERROR_FAILED);
+    }
+}
+
+/*
+ * Describe the in-flight operations and their pending steps, so stuck
+ * requests can be diagnosed.
+ */
+GVariant *cad_pulse_describe_operations(void)
+{
+    CadPulse *self = cad_pulse_get_default();
+    gint64 now = g_get_monotonic_time();
+    GVariantBuilder builder;
+    GList *l;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("aa{sv}"));
+
+    for (l = self->operations; l; l = l->next) {
+        CadPulseOperation *operation = l->data;
+        GVariantBuilder steps;
+        GVariantDict dict;
+
+        g_variant_builder_init(&steps, G_VARIANT_TYPE("aa{sv}"));
+        for (i = 0; i < operation->steps->len; i++) {
+            CadPulseStep *step = g_ptr_array_index(operation->steps, i);
+            GVariantDict step_dict;
+
+            if (!step->pa_op && step->started)
+                continue;
+
+            g_variant_dict_init(&step_dict, NULL);
+            g_variant_dict_insert(&step_dict, "name", "s", step->name);
+            g_variant_dict_insert(&step_dict, "in-flight", "b", step->pa_op != NULL);
+            if (step->pa_op) {
+                g_variant_dict_insert(&step_dict, "elapsed-us", "t",
+                                      (guint64)(now - step->start_time));
+                g_variant_dict_insert(&step_dict, "timeout-us", "t",
+                                      (guint64)step_timeout(self, step->name) * 1000);
+            }
+            g_variant_builder_add(&steps, "@a{sv}", g_variant_dict_end(&step_dict));
+        }
+
+        g_variant_dict_init(&dict, NULL);
+        if (operation->op) {
+            g_variant_dict_insert(&dict, "type", "u", operation->op->type);
+            g_variant_dict_insert(&dict, "age-us", "t",
+                                  (guint64)(now - operation->op->received));
+        }
+        g_variant_dict_insert(&dict, "mode", "u", operation->mode);
+        g_variant_dict_insert(&dict, "pending-steps", "u", operation->n_pending);
+        g_variant_dict_insert_value(&dict, "steps", g_variant_builder_end(&steps));
+
+        g_variant_builder_add(&builder, "@a{sv}", g_variant_dict_end(&dict));
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+/*
+ * Whether requests can be executed right now. Requests received while the
+ * backend isn't ready should be kept until it is.
+ */
+gboolean cad_pulse_is_ready(void)
+{
+    return cad_pulse_get_default()->ready;
+}
+
+/*
+ * The routing policy changed: read every known object again so they're
+ * classified according to the new one, and the devices used for calls
+ * picked again.
+ */
+void cad_pulse_reload_policy(void)
+{
+    CadPulse *self = cad_pulse_get_default();
+    GHashTableIter iter;
+    gpointer key;
+
+    if (!self->ctx || pa_context_get_state(self->ctx) != PA_CONTEXT_READY)
+        return;
+
+    g_debug("routing policy changed, refreshing devices");
+
+    g_hash_table_iter_init(&iter, self->cards);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        refresh_object(self, PA_SUBSCRIPTION_EVENT_CARD, GPOINTER_TO_UINT(key));
+    g_hash_table_iter_init(&iter, self->sinks);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        refresh_object(self, PA_SUBSCRIPTION_EVENT_SINK, GPOINTER_TO_UINT(key));
+    g_hash_table_iter_init(&iter, self->sources);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        refresh_object(self, PA_SUBSCRIPTION_EVENT_SOURCE, GPOINTER_TO_UINT(key));
+}
+
+/*
+ * Set how long the call profile is kept after switching to the default mode
+ * was requested, in milliseconds; 0 switches immediately.
+ */
+void cad_pulse_set_linger(guint milliseconds)
+{
+    linger_time = milliseconds;
+}
+
+/*
+ * Compute the ports a call would use. Switching to the call profile of ALSA
+ * UCM and Bluetooth cards brings other devices, so only the ports of cards
+ * without a voice profile, or droid ones, can be planned for.
+ */
+static void prepare_plan(CadPulse *self)
+{
+    CadPulsePlan *plan = &self->plan;
+
+    discard_plan(self);
+
+    if (!self->card || !self->sink)
+        return;
+
+    /* The devices may have changed while reading them again */
+    if (profile_replaces_devices(self)) {
+        g_debug("call not prepared, profile switch changes the devices");
+        return;
+    }
+
+    plan->output_port = get_available_output(self->sink, CAD_POLICY_PORT_SPEAKER |
+                                                         CAD_POLICY_PORT_PARKING);
+    if (plan->output_port < 0)
+        return;
+
+    plan->sink = self->sink->index;
+    plan->source = PA_INVALID_INDEX;
+    plan->input_port = -1;
+    if (self->source) {
+        plan->source = self->source->index;
+        plan->input_port = get_best_input(self->source,
+                                          paired_input_class(self->sink, plan->output_port));
+    }
+    plan->valid = TRUE;
+
+    g_debug("call prepared: output '%s', input '%s'",
+            port_name(self->sink, plan->output_port),
+            self->source ? port_name(self->source, plan->input_port) : NULL);
+}
+
+static void prepare_state_cb(pa_operation *op, void *data)
+{
+    if (pa_operation_get_state(op) != PA_OPERATION_DONE)
+        return;
+
+    prepare_plan(data);
+}
+
+/*
+ * A call is ringing: read the devices which would be used to answer it again
+ * and work out the ports to select, so switching to the call mode doesn't
+ * involve any query or lookup. Nothing is written to PA, so rejecting the
+ * call requires no cleanup.
+ *
+ * Returns FALSE if the backend can't route calls right now, or if there's
+ * nothing to prepare: the call profile of UCM and Bluetooth cards brings its
+ * own devices and selects their ports, the cache being up to date otherwise.
+ */
+gboolean cad_pulse_prepare_call(void)
+{
+    CadPulse *self = cad_pulse_get_default();
+    pa_operation *ops[3];
+    pa_operation *last = NULL;
+    guint i;
+
+    if (!self->ready || !self->card)
+        return FALSE;
+
+    if (profile_replaces_devices(self)) {
+        g_debug("nothing to prepare for calls on card %u", self->card->index);
+        return FALSE;
     }
-    if (operation)
-        free(operation);
+
+    g_debug("preparing call on card %u", self->card->index);
+
+    /* Replies come in order, the plan is computed once the last one is in */
+    ops[0] = query_object(self, PA_SUBSCRIPTION_EVENT_CARD, self->card->index);
+    ops[1] = self->sink ? query_object(self, PA_SUBSCRIPTION_EVENT_SINK, self->sink->index) : NULL;
+    ops[2] = self->source ? query_object(self, PA_SUBSCRIPTION_EVENT_SOURCE, self->source->index) : NULL;
+
+    for (i = 0; i < G_N_ELEMENTS(ops); i++) {
+        if (ops[i])
+            last = ops[i];
+    }
+
+    if (last)
+        pa_operation_set_state_callback(last, prepare_state_cb, self);
+    else
+        prepare_plan(self);
+
+    for (i = 0; i < G_N_ELEMENTS(ops); i++) {
+        if (ops[i])
+            pa_operation_unref(ops[i]);
+    }
+
+    return TRUE;
 }
@@ -15,11 +15,23 @@ G_BEGIN_DECLS
 
 #define CAD_TYPE_PULSE (cad_pulse_get_type())
 
+/* How long the call profile is kept after a call ends, in milliseconds */
+#define CAD_PULSE_DEFAULT_LINGER 2000
+
 G_DECLARE_FINAL_TYPE(CadPulse, cad_pulse, CAD, PULSE, GObject);
 
 CadPulse *cad_pulse_get_default(void);
 void cad_pulse_select_mode(guint mode, CadOperation *op);
 void cad_pulse_enable_speaker(gboolean enable, CadOperation *op);
 void cad_pulse_mute_mic(gboolean mute, CadOperation *op);
+void cad_pulse_apply_route(const CadRoute *route, CadOperation *op);
+void cad_pulse_reroute(CadOperation *op);
+void cad_pulse_restore(CadOperation *op);
+void cad_pulse_cancel(CadOperation *op, CadOperationError error);
+gboolean cad_pulse_is_ready(void);
+GVariant *cad_pulse_describe_operations(void);
+void cad_pulse_reload_policy(void);
+void cad_pulse_set_linger(guint milliseconds);
+gboolean cad_pulse_prepare_call(void);
 
 G_END_DECLS
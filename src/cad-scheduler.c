@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-scheduler"
+
+#include "cad-scheduler.h"
+#include "cad-pulse.h"
+
+#include "libcallaudio.h"
+
+/*
+ * Operations are queued per audio resource they modify: an operation is only
+ * started once no running or earlier queued operation touches any of its
+ * resources, so writes to a given resource happen one at a time and in
+ * order. When a new request arrives while an operation of the same type is
+ * still waiting in the queue, the queued one would be overridden anyway: it
+ * is completed right away without ever reaching PulseAudio.
+ *
+ * A new mode change (SelectMode, or ApplyRoute with a mode) also preempts the
+ * one currently running, if any: its in-flight PA requests are cancelled and
+ * it fails as superseded, so the new mode is applied without waiting for the
+ * stale chain to complete. Putting a call on hold is the exception, as it
+ * needs the call mode being applied: it neither preempts nor supersedes
+ * another mode change. Mode changes issued for call sessions are never
+ * superseded or preempted by other requests, nor do they supersede or
+ * preempt them: the session bookkeeping relies on each of them completing.
+ *
+ * While the backend isn't ready (still discovering devices at startup, or
+ * PulseAudio restarting), requests are kept in the queue and replayed in
+ * order once it is; those still waiting after the deadline are failed.
+ */
+
+typedef enum {
+    CAD_RESOURCE_CARD_PROFILE = 1 << 0,
+    CAD_RESOURCE_SINK_PORT    = 1 << 1,
+    CAD_RESOURCE_SOURCE_PORT  = 1 << 2,
+    CAD_RESOURCE_SOURCE_MUTE  = 1 << 3,
+} CadResource;
+
+typedef struct _CadSchedulerEntry {
+    CadOperation *op;
+    CadOperationCallback callback;
+    guint resources;
+    guint deadline_id;
+} CadSchedulerEntry;
+
+static GQueue pending = G_QUEUE_INIT;
+static GList *running;
+static gboolean dispatching;
+static gboolean initialized;
+static guint deadline = CAD_SCHEDULER_DEFAULT_DEADLINE;
+
+static guint operation_resources(CadOperation *op)
+{
+    switch (op->type) {
+    case CAD_OPERATION_SELECT_MODE:
+        return CAD_RESOURCE_CARD_PROFILE | CAD_RESOURCE_SINK_PORT |
+               CAD_RESOURCE_SOURCE_PORT | CAD_RESOURCE_SOURCE_MUTE;
+    case CAD_OPERATION_ENABLE_SPEAKER:
+        return CAD_RESOURCE_SINK_PORT | CAD_RESOURCE_SOURCE_PORT;
+    case CAD_OPERATION_MUTE_MIC:
+        return CAD_RESOURCE_SOURCE_MUTE;
+    case CAD_OPERATION_APPLY_ROUTE:
+        return CAD_RESOURCE_CARD_PROFILE | CAD_RESOURCE_SINK_PORT |
+               CAD_RESOURCE_SOURCE_PORT | CAD_RESOURCE_SOURCE_MUTE;
+    case CAD_OPERATION_REROUTE:
+        return CAD_RESOURCE_SINK_PORT | CAD_RESOURCE_SOURCE_PORT;
+    case CAD_OPERATION_RESTORE:
+        return CAD_RESOURCE_CARD_PROFILE | CAD_RESOURCE_SINK_PORT |
+               CAD_RESOURCE_SOURCE_PORT | CAD_RESOURCE_SOURCE_MUTE;
+    default:
+        g_critical("unknown operation %d", op->type);
+        return 0;
+    }
+}
+
+static void dispatch(void);
+
+static void entry_free(CadSchedulerEntry *entry)
+{
+    g_clear_handle_id(&entry->deadline_id, g_source_remove);
+    g_free(entry);
+}
+
+static void entry_complete_cb(CadOperation *op)
+{
+    CadSchedulerEntry *entry = NULL;
+    GList *l;
+
+    for (l = running; l; l = l->next) {
+        CadSchedulerEntry *e = l->data;
+
+        if (e->op == op) {
+            entry = e;
+            running = g_list_delete_link(running, l);
+            break;
+        }
+    }
+
+    g_return_if_fail(entry != NULL);
+
+    g_debug("operation %d completed (success=%d)", op->type, op->success);
+
+    op->callback = entry->callback;
+    entry_free(entry);
+    op->callback(op);
+
+    dispatch();
+}
+
+static void start(CadSchedulerEntry *entry)
+{
+    CadOperation *op = entry->op;
+
+    g_clear_handle_id(&entry->deadline_id, g_source_remove);
+    running = g_list_append(running, entry);
+
+    switch (op->type) {
+    case CAD_OPERATION_SELECT_MODE:
+        cad_pulse_select_mode(op->value, op);
+        break;
+    case CAD_OPERATION_ENABLE_SPEAKER:
+        cad_pulse_enable_speaker((gboolean)op->value, op);
+        break;
+    case CAD_OPERATION_MUTE_MIC:
+        cad_pulse_mute_mic((gboolean)op->value, op);
+        break;
+    case CAD_OPERATION_APPLY_ROUTE:
+        cad_pulse_apply_route(&op->route, op);
+        break;
+    case CAD_OPERATION_REROUTE:
+        cad_pulse_reroute(op);
+        break;
+    case CAD_OPERATION_RESTORE:
+        cad_pulse_restore(op);
+        break;
+    default:
+        op->success = FALSE;
+        op->callback(op);
+        break;
+    }
+}
+
+static void dispatch(void)
+{
+    gboolean progress = TRUE;
+
+    /* Operations may complete synchronously, don't re-enter the loop */
+    if (dispatching || !cad_pulse_is_ready())
+        return;
+
+    dispatching = TRUE;
+    while (progress && cad_pulse_is_ready()) {
+        guint busy = 0;
+        GList *l;
+
+        progress = FALSE;
+
+        for (l = running; l; l = l->next) {
+            CadSchedulerEntry *entry = l->data;
+            busy |= entry->resources;
+        }
+
+        for (l = pending.head; l; l = l->next) {
+            CadSchedulerEntry *entry = l->data;
+
+            if (entry->resources & busy) {
+                /* Keep the queue ordered for every resource of this entry */
+                busy |= entry->resources;
+                continue;
+            }
+
+            g_queue_delete_link(&pending, l);
+            start(entry);
+            progress = TRUE;
+            break;
+        }
+    }
+    dispatching = FALSE;
+}
+
+static guint requested_mode(CadOperation *op)
+{
+    if (op->type == CAD_OPERATION_SELECT_MODE)
+        return op->value;
+    if (op->type == CAD_OPERATION_APPLY_ROUTE)
+        return op->route.mode;
+
+    return CALL_AUDIO_MODE_UNKNOWN;
+}
+
+static gboolean is_mode_change(CadOperation *op)
+{
+    return requested_mode(op) != CALL_AUDIO_MODE_UNKNOWN;
+}
+
+/* Whether @op holds the call, which must be ongoing */
+static gboolean is_hold(CadOperation *op)
+{
+    return requested_mode(op) == CALL_AUDIO_MODE_HOLD;
+}
+
+/*
+ * Whether executing @op makes @queued pointless
+ */
+static gboolean supersedes(CadOperation *op, CadOperation *queued)
+{
+    if (op->type != queued->type || op->session || queued->session)
+        return FALSE;
+
+    if (is_hold(op) && is_mode_change(queued) && !is_hold(queued))
+        return FALSE;
+
+    if (op->type == CAD_OPERATION_APPLY_ROUTE) {
+        /* Everything the queued route would change must be overridden */
+        if (queued->route.mode != CALL_AUDIO_MODE_UNKNOWN &&
+            op->route.mode == CALL_AUDIO_MODE_UNKNOWN)
+            return FALSE;
+        if (queued->route.speaker != CALL_AUDIO_SPEAKER_UNKNOWN &&
+            op->route.speaker == CALL_AUDIO_SPEAKER_UNKNOWN)
+            return FALSE;
+        if (queued->route.mic != CALL_AUDIO_MIC_UNKNOWN &&
+            op->route.mic == CALL_AUDIO_MIC_UNKNOWN)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void coalesce(CadOperation *op)
+{
+    GList *l = pending.head;
+
+    while (l) {
+        CadSchedulerEntry *entry = l->data;
+        GList *next = l->next;
+
+        if (supersedes(op, entry->op)) {
+            CadOperation *superseded = entry->op;
+
+            g_debug("operation %d superseded while queued, skipping it", op->type);
+
+            g_queue_delete_link(&pending, l);
+            superseded->callback = entry->callback;
+            superseded->success = TRUE;
+            entry_free(entry);
+            superseded->callback(superseded);
+        }
+
+        l = next;
+    }
+}
+
+static void preempt(CadOperation *op)
+{
+    GList *l;
+
+    if (!is_mode_change(op) || is_hold(op) || op->session)
+        return;
+
+    for (l = running; l; l = l->next) {
+        CadSchedulerEntry *entry = l->data;
+
+        if (is_mode_change(entry->op) && !entry->op->session) {
+            g_debug("preempting running mode change");
+            /* This completes the operation and removes it from the list */
+            cad_pulse_cancel(entry->op, CAD_OPERATION_ERROR_SUPERSEDED);
+            break;
+        }
+    }
+}
+
+static gboolean deadline_cb(gpointer data)
+{
+    CadSchedulerEntry *entry = data;
+    CadOperation *op = entry->op;
+
+    g_warning("operation %d timed out waiting for the backend", op->type);
+
+    entry->deadline_id = 0;
+    g_queue_remove(&pending, entry);
+    op->callback = entry->callback;
+    op->success = FALSE;
+    op->error = CAD_OPERATION_ERROR_FAILED;
+    entry_free(entry);
+    op->callback(op);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void arm_deadline(CadSchedulerEntry *entry)
+{
+    if (entry->deadline_id)
+        return;
+
+    entry->deadline_id = g_timeout_add_seconds(deadline, deadline_cb, entry);
+}
+
+static void ready_changed_cb(GObject *object, GParamSpec *pspec, gpointer data)
+{
+    GList *l;
+
+    if (cad_pulse_is_ready()) {
+        g_debug("backend ready, dispatching %u queued operations", pending.length);
+        dispatch();
+        return;
+    }
+
+    for (l = pending.head; l; l = l->next)
+        arm_deadline(l->data);
+}
+
+void cad_scheduler_set_deadline(guint seconds)
+{
+    g_debug("readiness deadline set to %us", seconds);
+    deadline = seconds;
+}
+
+void cad_scheduler_push(CadOperation *op)
+{
+    CadSchedulerEntry *entry;
+
+    g_return_if_fail(op != NULL);
+
+    if (!initialized) {
+        g_signal_connect(cad_pulse_get_default(), "notify::ready",
+                         G_CALLBACK(ready_changed_cb), NULL);
+        initialized = TRUE;
+    }
+
+    coalesce(op);
+    preempt(op);
+
+    entry = g_new0(CadSchedulerEntry, 1);
+    entry->op = op;
+    entry->callback = op->callback;
+    entry->resources = operation_resources(op);
+    op->callback = entry_complete_cb;
+
+    g_queue_push_tail(&pending, entry);
+
+    if (!cad_pulse_is_ready()) {
+        g_debug("backend not ready, queuing operation %d", op->type);
+        arm_deadline(entry);
+    }
+
+    dispatch();
+}
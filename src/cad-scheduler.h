@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "cad-operation.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* How long a request can wait for the backend to be ready, in seconds */
+#define CAD_SCHEDULER_DEFAULT_DEADLINE 10
+
+void cad_scheduler_push(CadOperation *op);
+void cad_scheduler_set_deadline(guint seconds);
+
+G_END_DECLS
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-session"
+
+#include "cad-session.h"
+#include "cad-scheduler.h"
+#include "cad-stats.h"
+#include "callaudiod.h"
+
+#include "libcallaudio.h"
+
+/*
+ * Call sessions let several clients hold calls at the same time: the voice
+ * call mode is selected when the first session begins, and the default mode
+ * restored when the last one ends, rather than each client toggling the
+ * global mode with SelectMode and pulling it from under the others. While
+ * sessions are active, the voice call mode is kept: selecting the default
+ * mode the legacy way is refused.
+ *
+ * A session belongs to the connection it was begun on, and to the caller's
+ * unique name on the message bus: it ends automatically when its owner goes
+ * away, so a crashed client doesn't keep the voice call mode forever.
+ */
+
+typedef struct _CadSession {
+    guint handle;
+    GDBusConnection *connection;
+    /* Unique bus name, NULL on peer connections */
+    gchar *owner;
+    guint watch_id;
+    gulong closed_id;
+} CadSession;
+
+/*
+ * Mode change issued for a session, @handle being the one which caused it,
+ * or 0 when applied again for the remaining ones
+ */
+typedef struct _CadSessionOperation {
+    CadOperation op;
+    guint handle;
+} CadSessionOperation;
+
+static GHashTable *sessions;
+static guint last_handle;
+
+static void session_free(CadSession *session)
+{
+    g_clear_handle_id(&session->watch_id, g_bus_unwatch_name);
+    if (session->closed_id)
+        g_signal_handler_disconnect(session->connection, session->closed_id);
+    g_object_unref(session->connection);
+    g_free(session->owner);
+    g_free(session);
+}
+
+static void return_error(CadOperation *op)
+{
+    if (op->error == CAD_OPERATION_ERROR_SUPERSEDED) {
+        g_dbus_method_invocation_return_dbus_error(op->invocation,
+                                                   CALLAUDIO_DBUS_ERROR_SUPERSEDED,
+                                                   "Operation superseded by a newer request");
+    } else {
+        g_dbus_method_invocation_return_error(op->invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_FAILED,
+                                              "Operation failed");
+    }
+}
+
+static gboolean session_remove(guint handle,
+                               CallAudioDbusCallAudio *object,
+                               GDBusMethodInvocation *invocation);
+static void push_mode(guint mode, guint handle,
+                      CallAudioDbusCallAudio *object,
+                      GDBusMethodInvocation *invocation);
+
+static void mode_done_cb(CadOperation *op)
+{
+    CadSessionOperation *session_op = (CadSessionOperation *)op;
+
+    g_debug("mode %u for session %u applied (success=%d)",
+            op->value, session_op->handle, op->success);
+
+    cad_stats_record_operation(op);
+
+    if (op->value == CALL_AUDIO_MODE_CALL && !op->invocation) {
+        if (!op->success)
+            g_warning("Unable to select voice call mode for the remaining sessions");
+    } else if (op->value == CALL_AUDIO_MODE_CALL) {
+        if (op->success) {
+            call_audio_dbus_call_audio_complete_begin_call(op->object, op->invocation,
+                                                           session_op->handle);
+        } else {
+            return_error(op);
+            /* The session never got the voice call mode, drop it */
+            session_remove(session_op->handle, NULL, NULL);
+
+            /* Sessions acknowledged in the meantime still need it */
+            if (cad_session_active())
+                push_mode(CALL_AUDIO_MODE_CALL, 0, NULL, NULL);
+        }
+    } else if (op->invocation) {
+        if (op->success)
+            call_audio_dbus_call_audio_complete_end_call(op->object, op->invocation, TRUE);
+        else
+            return_error(op);
+    }
+
+    g_free(session_op);
+}
+
+static void push_mode(guint mode, guint handle,
+                      CallAudioDbusCallAudio *object,
+                      GDBusMethodInvocation *invocation)
+{
+    CadSessionOperation *session_op = g_new0(CadSessionOperation, 1);
+
+    session_op->op.type = CAD_OPERATION_SELECT_MODE;
+    session_op->op.object = object;
+    session_op->op.invocation = invocation;
+    session_op->op.callback = mode_done_cb;
+    session_op->op.received = g_get_monotonic_time();
+    session_op->op.value = mode;
+    session_op->op.session = TRUE;
+    session_op->handle = handle;
+
+    g_debug("selecting mode %u for session %u", mode, handle);
+    cad_scheduler_push(&session_op->op);
+}
+
+gboolean cad_session_active(void)
+{
+    return sessions && g_hash_table_size(sessions) > 0;
+}
+
+/*
+ * End a session, switching back to the default mode if it was the last one.
+ * If @invocation isn't NULL, it is completed once this is done.
+ */
+static gboolean session_remove(guint handle,
+                               CallAudioDbusCallAudio *object,
+                               GDBusMethodInvocation *invocation)
+{
+    if (!sessions || !g_hash_table_remove(sessions, GUINT_TO_POINTER(handle)))
+        return FALSE;
+
+    g_debug("session %u ended, %u left", handle, g_hash_table_size(sessions));
+
+    if (g_hash_table_size(sessions) == 0)
+        push_mode(CALL_AUDIO_MODE_DEFAULT, handle, object, invocation);
+    else if (invocation)
+        call_audio_dbus_call_audio_complete_end_call(object, invocation, TRUE);
+
+    return TRUE;
+}
+
+static void owner_vanished_cb(GDBusConnection *connection,
+                              const gchar *name,
+                              gpointer user_data)
+{
+    guint handle = GPOINTER_TO_UINT(user_data);
+
+    g_debug("owner '%s' of session %u vanished", name, handle);
+    session_remove(handle, NULL, NULL);
+}
+
+static void connection_closed_cb(GDBusConnection *connection,
+                                 gboolean remote_peer_vanished,
+                                 GError *error,
+                                 gpointer user_data)
+{
+    guint handle = GPOINTER_TO_UINT(user_data);
+
+    g_debug("connection of session %u closed", handle);
+    session_remove(handle, NULL, NULL);
+}
+
+void cad_session_begin(CallAudioDbusCallAudio *object,
+                       GDBusMethodInvocation *invocation)
+{
+    const gchar *sender = g_dbus_method_invocation_get_sender(invocation);
+    CadSession *session;
+
+    if (!sessions)
+        sessions = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)session_free);
+
+    session = g_new0(CadSession, 1);
+
+    /* 0 is never used, so clients can use it for "no session" */
+    do {
+        last_handle++;
+    } while (last_handle == 0 ||
+             g_hash_table_contains(sessions, GUINT_TO_POINTER(last_handle)));
+
+    session->handle = last_handle;
+    session->connection = g_object_ref(g_dbus_method_invocation_get_connection(invocation));
+    session->owner = g_strdup(sender);
+
+    if (sender) {
+        session->watch_id = g_bus_watch_name_on_connection(session->connection, sender,
+                                                           G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                           NULL, owner_vanished_cb,
+                                                           GUINT_TO_POINTER(session->handle),
+                                                           NULL);
+    } else {
+        session->closed_id = g_signal_connect(session->connection, "closed",
+                                              G_CALLBACK(connection_closed_cb),
+                                              GUINT_TO_POINTER(session->handle));
+    }
+
+    g_hash_table_insert(sessions, GUINT_TO_POINTER(session->handle), session);
+
+    g_debug("session %u begun by '%s', %u active", session->handle,
+            sender ? sender : "peer", g_hash_table_size(sessions));
+
+    if (g_hash_table_size(sessions) == 1)
+        push_mode(CALL_AUDIO_MODE_CALL, session->handle, object, invocation);
+    else
+        call_audio_dbus_call_audio_complete_begin_call(object, invocation, session->handle);
+}
+
+void cad_session_end(CallAudioDbusCallAudio *object,
+                     GDBusMethodInvocation *invocation,
+                     guint handle)
+{
+    CadSession *session = NULL;
+
+    if (sessions)
+        session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(handle));
+
+    /* Only the session's owner can end it */
+    if (!session ||
+        session->connection != g_dbus_method_invocation_get_connection(invocation) ||
+        g_strcmp0(session->owner, g_dbus_method_invocation_get_sender(invocation)) != 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_INVALID_ARGS,
+                                              "Unknown call session %u", handle);
+        return;
+    }
+
+    session_remove(handle, object, invocation);
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "callaudio-dbus.h"
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void cad_session_begin(CallAudioDbusCallAudio *object,
+                       GDBusMethodInvocation  *invocation);
+void cad_session_end  (CallAudioDbusCallAudio *object,
+                       GDBusMethodInvocation  *invocation,
+                       guint                   handle);
+
+gboolean cad_session_active(void);
+
+G_END_DECLS
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Layout of the state page shared by callaudiod with its clients through a
+ * sealed memfd (see the GetStatePage D-Bus method).
+ *
+ * The page is protected by a sequence lock: the daemon increments @sequence
+ * before and after each update, so it is odd while an update is in progress.
+ * Readers must retry if @sequence was odd or changed while they were copying
+ * the page contents.
+ *
+ * @generation is incremented on each state change; @closed is set when the
+ * daemon exits, meaning the page won't be updated anymore.
+ */
+
+#define CAD_STATE_PAGE_MAGIC    0x53444143 /* "CADS" */
+#define CAD_STATE_PAGE_VERSION  1
+#define CAD_STATE_PORT_NAME_MAX 64
+
+typedef struct _CadStatePage {
+    guint32 magic;
+    guint32 version;
+    guint32 size;
+    gint    sequence;
+    guint64 generation;
+
+    guint32 closed;
+    guint32 available;
+    guint32 mode;
+    guint32 speaker;
+    guint32 mic;
+    gchar   output_port[CAD_STATE_PORT_NAME_MAX];
+    gchar   input_port[CAD_STATE_PORT_NAME_MAX];
+} CadStatePage;
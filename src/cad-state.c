@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+#define G_LOG_DOMAIN "callaudiod-state"
+
+#include "cad-state.h"
+
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * The current state is published in a memfd which clients can map read-only,
+ * so they can sample it without any D-Bus round-trip. Clients are handed a
+ * read-only descriptor, and the file is sealed so it can't be resized under
+ * our own mapping (nor written to through new mappings, where supported).
+ */
+
+static gint state_fd = -1;
+static CadStatePage *page;
+
+static void seal(gint fd)
+{
+    guint seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+#ifdef F_SEAL_FUTURE_WRITE
+    /* Our own mapping stays writable, new ones can only be read-only */
+    if (fcntl(fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) == 0)
+        return;
+
+    /* Only supported since Linux 5.1, the other seals matter all the same */
+    g_debug("Unable to seal state page against writes: %s", g_strerror(errno));
+#endif
+    if (fcntl(fd, F_ADD_SEALS, seals) < 0)
+        g_warning("Unable to seal state page: %s", g_strerror(errno));
+}
+
+gboolean cad_state_init(GError **error)
+{
+    gsize size = MAX(sizeof(CadStatePage), (gsize)sysconf(_SC_PAGESIZE));
+    g_autofree gchar *path = NULL;
+    gint fd;
+
+    if (page)
+        return TRUE;
+
+    fd = memfd_create("callaudiod-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        goto error;
+
+    if (ftruncate(fd, size) < 0)
+        goto error;
+
+    page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        page = NULL;
+        goto error;
+    }
+
+    seal(fd);
+
+    /* The writable descriptor isn't needed anymore once mapped */
+    path = g_strdup_printf("/proc/self/fd/%d", fd);
+    state_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (state_fd < 0)
+        goto error;
+    close(fd);
+
+    page->magic = CAD_STATE_PAGE_MAGIC;
+    page->version = CAD_STATE_PAGE_VERSION;
+    page->size = sizeof(CadStatePage);
+    page->mode = page->speaker = page->mic = 255;
+
+    g_debug("state page created (fd=%d)", state_fd);
+
+    return TRUE;
+
+error:
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                "Unable to create state page: %s", g_strerror(errno));
+    if (page) {
+        munmap(page, size);
+        page = NULL;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    return FALSE;
+}
+
+gint cad_state_get_fd(void)
+{
+    return state_fd;
+}
+
+/* The fences keep the page stores between the two sequence increments */
+static void begin_write(void)
+{
+    g_atomic_int_inc(&page->sequence);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_write(void)
+{
+    page->generation++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    g_atomic_int_inc(&page->sequence);
+}
+
+void cad_state_close(void)
+{
+    if (!page)
+        return;
+
+    begin_write();
+    page->closed = TRUE;
+    page->available = FALSE;
+    end_write();
+}
+
+void cad_state_update(guint mode, guint speaker, guint mic, gboolean available,
+                      const gchar *output_port, const gchar *input_port)
+{
+    if (!page)
+        return;
+
+    if (!output_port)
+        output_port = "";
+    if (!input_port)
+        input_port = "";
+
+    if (page->mode == mode && page->speaker == speaker && page->mic == mic &&
+        page->available == (guint32)available &&
+        strncmp(page->output_port, output_port, CAD_STATE_PORT_NAME_MAX - 1) == 0 &&
+        strncmp(page->input_port, input_port, CAD_STATE_PORT_NAME_MAX - 1) == 0)
+        return;
+
+    begin_write();
+    page->mode = mode;
+    page->speaker = speaker;
+    page->mic = mic;
+    page->available = available;
+    g_strlcpy(page->output_port, output_port, CAD_STATE_PORT_NAME_MAX);
+    g_strlcpy(page->input_port, input_port, CAD_STATE_PORT_NAME_MAX);
+    end_write();
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "cad-state-page.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_state_init(GError **error);
+void     cad_state_close(void);
+gint     cad_state_get_fd(void);
+void     cad_state_update(guint mode, guint speaker, guint mic, gboolean available,
+                          const gchar *output_port, const gchar *input_port);
+
+G_END_DECLS
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-stats"
+
+#include "cad-stats.h"
+#include "cad-pulse.h"
+
+#include <string.h>
+
+/*
+ * Latencies are stored in log2 buckets: bucket N counts durations between
+ * 2^N and 2^(N+1) microseconds (bucket 0 also holds anything shorter, the
+ * last one anything longer, ~16s).
+ */
+#define CAD_STATS_BUCKETS 24
+
+typedef struct _CadHistogram {
+    guint64 count;
+    guint64 total;
+    guint64 max;
+    guint64 buckets[CAD_STATS_BUCKETS];
+} CadHistogram;
+
+typedef struct _CadOperationStats {
+    guint64 success;
+    guint64 failure;
+    guint64 superseded;
+    guint64 noop;
+
+    /* From D-Bus receipt to the first PA request */
+    CadHistogram dispatch;
+    /* From D-Bus receipt to completion */
+    CadHistogram latency;
+} CadOperationStats;
+
+typedef struct _CadStats {
+    CallAudioDbusCallAudioStatsSkeleton parent;
+
+    CadOperationStats operations[CAD_OPERATION_APPLY_ROUTE + 1];
+    /* Step name -> CadHistogram */
+    GHashTable *steps;
+    /* Indexed by CadStatsLinger */
+    guint64 linger[CAD_STATS_LINGER_EXPIRED + 1];
+} CadStats;
+
+static void cad_stats_call_audio_stats_iface_init(CallAudioDbusCallAudioStatsIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(CadStats, cad_stats,
+                        CALL_AUDIO_DBUS_TYPE_CALL_AUDIO_STATS_SKELETON,
+                        G_IMPLEMENT_INTERFACE(CALL_AUDIO_DBUS_TYPE_CALL_AUDIO_STATS,
+                                              cad_stats_call_audio_stats_iface_init));
+
+static const gchar *operation_names[] = {
+    [CAD_OPERATION_SELECT_MODE] = "SelectMode",
+    [CAD_OPERATION_ENABLE_SPEAKER] = "EnableSpeaker",
+    [CAD_OPERATION_MUTE_MIC] = "MuteMic",
+    [CAD_OPERATION_APPLY_ROUTE] = "ApplyRoute",
+};
+
+static void histogram_add(CadHistogram *histogram, gint64 duration)
+{
+    guint64 value = MAX(duration, 0);
+    guint bucket = value > 1 ? g_bit_nth_msf(value, -1) : 0;
+
+    histogram->count++;
+    histogram->total += value;
+    histogram->max = MAX(histogram->max, value);
+    histogram->buckets[MIN(bucket, CAD_STATS_BUCKETS - 1)]++;
+}
+
+static void add_histogram(GVariantDict *dict, const gchar *prefix,
+                          const CadHistogram *histogram)
+{
+    g_autofree gchar *count = g_strconcat(prefix, "-count", NULL);
+    g_autofree gchar *total = g_strconcat(prefix, "-total-us", NULL);
+    g_autofree gchar *max = g_strconcat(prefix, "-max-us", NULL);
+    g_autofree gchar *buckets = g_strconcat(prefix, "-buckets", NULL);
+
+    g_variant_dict_insert(dict, count, "t", histogram->count);
+    g_variant_dict_insert(dict, total, "t", histogram->total);
+    g_variant_dict_insert(dict, max, "t", histogram->max);
+    g_variant_dict_insert_value(dict, buckets,
+                                g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64,
+                                                          histogram->buckets,
+                                                          CAD_STATS_BUCKETS,
+                                                          sizeof(guint64)));
+}
+
+void cad_stats_record_operation(CadOperation *op)
+{
+    CadStats *self = cad_stats_get_default();
+    CadOperationStats *stats;
+    gint64 now = g_get_monotonic_time();
+
+    if (op->type > CAD_OPERATION_APPLY_ROUTE)
+        return;
+
+    stats = &self->operations[op->type];
+    if (op->success)
+        stats->success++;
+    else if (op->error == CAD_OPERATION_ERROR_SUPERSEDED)
+        stats->superseded++;
+    else
+        stats->failure++;
+
+    // Nothing was sent to PA: either already in the requested state or
+    // completed without being executed
+    if (op->started == 0) {
+        if (op->success)
+            stats->noop++;
+    } else {
+        histogram_add(&stats->dispatch, op->started - op->received);
+    }
+
+    histogram_add(&stats->latency, now - op->received);
+
+    g_debug("%s completed in %" G_GINT64_FORMAT "us (success=%d)",
+            operation_names[op->type], now - op->received, op->success);
+}
+
+void cad_stats_record_step(const gchar *name, gint64 duration)
+{
+    CadStats *self = cad_stats_get_default();
+    CadHistogram *histogram = g_hash_table_lookup(self->steps, name);
+
+    if (!histogram) {
+        histogram = g_new0(CadHistogram, 1);
+        g_hash_table_insert(self->steps, g_strdup(name), histogram);
+    }
+
+    histogram_add(histogram, duration);
+}
+
+void cad_stats_record_linger(CadStatsLinger event)
+{
+    CadStats *self = cad_stats_get_default();
+
+    self->linger[event]++;
+}
+
+static gboolean cad_stats_handle_get_stats(CallAudioDbusCallAudioStats *object,
+                                           GDBusMethodInvocation *invocation)
+{
+    CadStats *self = CAD_STATS(object);
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{sv}}"));
+
+    for (i = 0; i < G_N_ELEMENTS(self->operations); i++) {
+        CadOperationStats *stats = &self->operations[i];
+        GVariantDict dict;
+
+        g_variant_dict_init(&dict, NULL);
+        g_variant_dict_insert(&dict, "success", "t", stats->success);
+        g_variant_dict_insert(&dict, "failure", "t", stats->failure);
+        g_variant_dict_insert(&dict, "superseded", "t", stats->superseded);
+        g_variant_dict_insert(&dict, "noop", "t", stats->noop);
+        add_histogram(&dict, "dispatch", &stats->dispatch);
+        add_histogram(&dict, "latency", &stats->latency);
+
+        g_variant_builder_add(&builder, "{s@a{sv}}", operation_names[i],
+                              g_variant_dict_end(&dict));
+    }
+
+    {
+        GVariantDict dict;
+
+        g_variant_dict_init(&dict, NULL);
+        g_variant_dict_insert(&dict, "deferred", "t", self->linger[CAD_STATS_LINGER_DEFERRED]);
+        g_variant_dict_insert(&dict, "avoided", "t", self->linger[CAD_STATS_LINGER_AVOIDED]);
+        g_variant_dict_insert(&dict, "expired", "t", self->linger[CAD_STATS_LINGER_EXPIRED]);
+
+        g_variant_builder_add(&builder, "{s@a{sv}}", "Linger",
+                              g_variant_dict_end(&dict));
+    }
+
+    g_hash_table_iter_init(&iter, self->steps);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_autofree gchar *name = g_strconcat("step:", key, NULL);
+        GVariantDict dict;
+
+        g_variant_dict_init(&dict, NULL);
+        add_histogram(&dict, "latency", value);
+
+        g_variant_builder_add(&builder, "{s@a{sv}}", name,
+                              g_variant_dict_end(&dict));
+    }
+
+    call_audio_dbus_call_audio_stats_complete_get_stats(object, invocation,
+                                                        g_variant_builder_end(&builder));
+    return TRUE;
+}
+
+static gboolean cad_stats_handle_reset(CallAudioDbusCallAudioStats *object,
+                                       GDBusMethodInvocation *invocation)
+{
+    CadStats *self = CAD_STATS(object);
+
+    g_debug("resetting statistics");
+
+    memset(self->operations, 0, sizeof(self->operations));
+    memset(self->linger, 0, sizeof(self->linger));
+    g_hash_table_remove_all(self->steps);
+
+    call_audio_dbus_call_audio_stats_complete_reset(object, invocation);
+    return TRUE;
+}
+
+static gboolean cad_stats_handle_get_operations(CallAudioDbusCallAudioStats *object,
+                                                GDBusMethodInvocation *invocation)
+{
+    call_audio_dbus_call_audio_stats_complete_get_operations(object, invocation,
+                                                             cad_pulse_describe_operations());
+    return TRUE;
+}
+
+static void cad_stats_finalize(GObject *object)
+{
+    CadStats *self = CAD_STATS(object);
+
+    g_hash_table_unref(self->steps);
+
+    G_OBJECT_CLASS(cad_stats_parent_class)->finalize(object);
+}
+
+static void cad_stats_call_audio_stats_iface_init(CallAudioDbusCallAudioStatsIface *iface)
+{
+    iface->handle_get_stats = cad_stats_handle_get_stats;
+    iface->handle_reset = cad_stats_handle_reset;
+    iface->handle_get_operations = cad_stats_handle_get_operations;
+}
+
+static void cad_stats_class_init(CadStatsClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = cad_stats_finalize;
+}
+
+static void cad_stats_init(CadStats *self)
+{
+    self->steps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+CadStats *cad_stats_get_default(void)
+{
+    static CadStats *stats;
+
+    if (stats == NULL) {
+        g_debug("initializing stats...");
+        stats = g_object_new(CAD_TYPE_STATS, NULL);
+        g_object_add_weak_pointer(G_OBJECT(stats), (gpointer *)&stats);
+    }
+
+    return stats;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "callaudio-dbus.h"
+
+#include "cad-operation.h"
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define CAD_TYPE_STATS (cad_stats_get_type())
+
+G_DECLARE_FINAL_TYPE(CadStats, cad_stats, CAD, STATS,
+                     CallAudioDbusCallAudioStatsSkeleton);
+
+CadStats *cad_stats_get_default(void);
+
+typedef enum {
+    /* Switch to the default mode deferred */
+    CAD_STATS_LINGER_DEFERRED = 0,
+    /* Call requested again before the deferred switch was done */
+    CAD_STATS_LINGER_AVOIDED,
+    /* Deferred switch done */
+    CAD_STATS_LINGER_EXPIRED,
+} CadStatsLinger;
+
+void cad_stats_record_operation(CadOperation *op);
+void cad_stats_record_step(const gchar *name, gint64 duration);
+void cad_stats_record_linger(CadStatsLinger event);
+
+G_END_DECLS
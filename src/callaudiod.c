@@ -9,7 +9,12 @@
 
 #include "callaudiod.h"
 #include "cad-manager.h"
+#include "cad-peer.h"
+#include "cad-policy.h"
 #include "cad-pulse.h"
+#include "cad-scheduler.h"
+#include "cad-state.h"
+#include "cad-stats.h"
 #include "config.h"
 
 #include <glib.h>
@@ -29,6 +34,16 @@ static gboolean quit_cb(gpointer user_data)
     return FALSE;
 }
 
+static gboolean reload_cb(gpointer user_data)
+{
+    g_info("Caught SIGHUP, reloading routing policy...");
+
+    cad_policy_load();
+    cad_pulse_reload_policy();
+
+    return TRUE;
+}
+
 
 static void bus_acquired_cb(GDBusConnection *connection, const gchar *name,
                             gpointer user_data)
@@ -39,13 +54,21 @@ static void bus_acquired_cb(GDBusConnection *connection, const gchar *name,
 
     g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(manager),
                                      connection, CALLAUDIO_DBUS_PATH, NULL);
+    g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(cad_stats_get_default()),
+                                     connection, CALLAUDIO_DBUS_PATH, NULL);
 }
 
 
 static void name_acquired_cb(GDBusConnection *connection, const gchar *name,
                              gpointer user_data)
 {
+    g_autoptr(GError) err = NULL;
+
     g_debug("Service name '%s' was acquired", name);
+
+    // Clients fall back to the bus if the private socket isn't available
+    if (!cad_peer_start(&err))
+        g_warning("Unable to start peer server: %s", err->message);
 }
 
 static void name_lost_cb(GDBusConnection *connection, const gchar *name,
@@ -66,11 +89,52 @@ static void name_lost_cb(GDBusConnection *connection, const gchar *name,
 
 int main(int argc, char **argv)
 {
+    g_autoptr(GOptionContext) opt_context = NULL;
+    g_autoptr(GError) err = NULL;
+    int deadline = CAD_SCHEDULER_DEFAULT_DEADLINE;
+    int linger = CAD_PULSE_DEFAULT_LINGER;
+
+    const GOptionEntry options [] = {
+        {"ready-timeout", 't', 0, G_OPTION_ARG_INT, &deadline,
+         "Time (in seconds) requests can wait for the audio server to be ready", "SECONDS"},
+        {"linger", 'l', 0, G_OPTION_ARG_INT, &linger,
+         "Time (in milliseconds) the call profile is kept after a call ends, 0 to disable", "MS"},
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+    };
+
+    opt_context = g_option_context_new("- Call audio routing daemon");
+    g_option_context_add_main_entries(opt_context, options, NULL);
+    if (!g_option_context_parse(opt_context, &argc, &argv, &err)) {
+        g_warning("%s", err->message);
+        return 1;
+    }
+
+    if (deadline <= 0) {
+        g_warning("Invalid readiness timeout %d", deadline);
+        return 1;
+    }
+    cad_scheduler_set_deadline(deadline);
+
+    if (linger < 0) {
+        g_warning("Invalid linger time %d", linger);
+        return 1;
+    }
+    cad_pulse_set_linger(linger);
+
     g_unix_signal_add(SIGTERM, quit_cb, NULL);
     g_unix_signal_add(SIGINT, quit_cb, NULL);
+    g_unix_signal_add(SIGHUP, reload_cb, NULL);
 
     main_loop = g_main_loop_new(NULL, FALSE);
 
+    // Clients can still use D-Bus properties if this fails
+    if (!cad_state_init(&err)) {
+        g_warning("%s", err->message);
+        g_clear_error(&err);
+    }
+
+    cad_policy_load();
+
     // Initialize the PulseAudio backend
     cad_pulse_get_default();
 
@@ -82,5 +146,8 @@ int main(int argc, char **argv)
     g_main_loop_run(main_loop);
     g_main_loop_unref(main_loop);
 
+    cad_peer_stop();
+    cad_state_close();
+
     return 0;
 }
@@ -9,4 +9,9 @@
 #define CALLAUDIO_DBUS_NAME "org.mobian_project.CallAudio"
 #define CALLAUDIO_DBUS_PATH "/org/mobian_project/CallAudio"
 
+#define CALLAUDIO_DBUS_ERROR_SUPERSEDED CALLAUDIO_DBUS_NAME ".Error.Superseded"
+
 #define CALLAUDIO_DBUS_TYPE G_BUS_TYPE_SESSION
+
+// Private peer-to-peer socket, relative to the user runtime directory
+#define CALLAUDIO_PEER_SOCKET "callaudiod.sock"
@@ -16,11 +16,13 @@ int main (int argc, char *argv[0])
     int mode = -1;
     int speaker = -1;
     int mic = -1;
+    gboolean status = FALSE;
 
     const GOptionEntry options [] = {
         {"select-mode", 'm', 0, G_OPTION_ARG_INT, &mode, "Select mode", NULL},
         {"enable-speaker", 's', 0, G_OPTION_ARG_INT, &speaker, "Enable speaker", NULL},
         {"mute-mic", 'u', 0, G_OPTION_ARG_INT, &mic, "Mute microphone", NULL},
+        {"status", 'S', 0, G_OPTION_ARG_NONE, &status, "Print current status", NULL},
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
     };
 
@@ -36,14 +38,33 @@ int main (int argc, char *argv[0])
         return 1;
     }
 
-    if (mode == CALL_AUDIO_MODE_DEFAULT || mode == CALL_AUDIO_MODE_CALL)
-        call_audio_select_mode(mode, NULL);
+    if (mode < CALL_AUDIO_MODE_DEFAULT || mode > CALL_AUDIO_MODE_HOLD)
+        mode = CALL_AUDIO_MODE_UNKNOWN;
+    if (speaker != 0 && speaker != 1)
+        speaker = -1;
+    if (mic != 0 && mic != 1)
+        mic = -1;
 
-    if (speaker == 0 || speaker == 1)
+    if ((mode != CALL_AUDIO_MODE_UNKNOWN) + (speaker >= 0) + (mic >= 0) > 1) {
+        /* Apply everything in a single operation */
+        call_audio_apply_route(mode,
+                               speaker >= 0 ? (CallAudioSpeakerState)speaker : CALL_AUDIO_SPEAKER_UNKNOWN,
+                               mic >= 0 ? (mic ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON) : CALL_AUDIO_MIC_UNKNOWN,
+                               NULL);
+    } else if (mode != CALL_AUDIO_MODE_UNKNOWN) {
+        call_audio_select_mode(mode, NULL);
+    } else if (speaker >= 0) {
         call_audio_enable_speaker((gboolean)speaker, NULL);
-
-    if (mic == 0 || mic == 1)
+    } else if (mic >= 0) {
         call_audio_mute_mic((gboolean)mic, NULL);
+    }
+
+    if (status) {
+        g_print("Available: %s\n", call_audio_is_available() ? "yes" : "no");
+        g_print("Mode:      %u\n", call_audio_get_audio_mode());
+        g_print("Speaker:   %u\n", call_audio_get_speaker_state());
+        g_print("Mic:       %u\n", call_audio_get_mic_state());
+    }
 
     call_audio_deinit ();
     return 0;